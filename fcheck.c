@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -8,483 +9,5251 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "include/types.h"
 #include "include/fs.h"
 
 #define BLOCK_SIZE (BSIZE)
 
+// When set, errors unwind to this point instead of exiting, so callers
+// such as the query shell can keep going after a failed check.
+jmp_buf *error_trap = NULL;
+char trapped_error[256];
+
+// The inode and block a check is looking at, 0 when unknown or not in a
+// check. Errors print them on a second line, with the inode's path.
+typedef struct _error_site {
+    uint inum;
+    uint block;
+} error_site;
+
+error_site current_site;
+uint *parent_map = NULL;   // inode -> parent directory, from the traversal
+
+void print_error_site(void);
+void metrics_record_error(const char *error_message);
+void crc32c_init(void);
+extern uint (*crc32c)(uint crc, const unsigned char *data, size_t length);
+
 void exit_with_error(const char *error_message) {
+    if (error_trap != NULL) {
+        snprintf(trapped_error, sizeof(trapped_error), "%s", error_message);
+        longjmp(*error_trap, 1);
+    }
     fprintf(stderr, "ERROR: %s\n", error_message);
+    print_error_site();
+    metrics_record_error(error_message);
     exit(1);
 }
 
+// Structures whose allocations are tallied for --mem-report.
+enum mem_category {
+  MEM_BLOCK_USAGE,
+  MEM_INODE_REFS,
+  MEM_TRAVERSAL_STACK,
+  MEM_DIRECTORY_LISTS,
+  MEM_VERDICT_CACHE,
+  MEM_REVERSE_MAP,
+  MEM_DIGEST,
+  MEM_EXTRACT,
+  MEM_SEAL,
+  MEM_TRACE,
+  MEM_DIFF,
+  MEM_PATH_INDEX,
+  MEM_SHELL,
+  MEM_INCREMENTAL,
+  MEM_EXPORT,
+  MEM_DEDUP,
+  MEM_THROTTLE,
+  MEM_CATEGORIES
+};
+
+const char *mem_category_names[] = {
+  "block usage counts", "inode reference counts", "traversal stack", "directory listings",
+  "verdict cache", "reverse block map", "digest hashes", "extract jobs", "seal checksums", "trace buffers",
+  "diff block flags", "path index", "shell indices",
+  "incremental state", "export buffers", "dedup hashes", "throttle read flags"
+};
+
+uint64_t mem_allocated[MEM_CATEGORIES];
+
+// Tallies bytes allocated for a structure. Growth by realloc counts the delta.
+static inline void mem_account(enum mem_category category, size_t bytes) {
+    __atomic_fetch_add(&mem_allocated[category], bytes, __ATOMIC_RELAXED);
+}
+
+// Allocates zeroed memory for the per-block and per-inode accounting arrays.
+// These are sized by on-disk fields and can be far larger than the stack.
+void *xcalloc(enum mem_category category, size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (ptr == NULL) {
+        perror("calloc failed");
+        exit(1);
+    }
+    mem_account(category, count * size);
+    return ptr;
+}
+
+// Allocates memory without touching it, so that the first write to each
+// page decides the NUMA node it lives on. The caller must initialise it.
+void *xmalloc_untouched(enum mem_category category, size_t count, size_t size) {
+    void *ptr = malloc(count * size > 0 ? count * size : 1);
+    if (ptr == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    mem_account(category, count * size);
+    return ptr;
+}
+
+// Copies a string into memory tallied under category.
+char *xstrdup(enum mem_category category, const char *string) {
+    size_t length = strlen(string) + 1;
+    return memcpy(xmalloc_untouched(category, length, 1), string, length);
+}
+
 enum inode_types {
   INODE_FILE = 2,
   INODE_DIR = 1,  
   INODE_DEV = 3
 };
 
+// Regions of the disk in on-disk order.
+// Layout: [ boot | super | inode blocks | bitmap | data blocks | log ]
+enum block_region {
+  REGION_BOOT,
+  REGION_SUPER,
+  REGION_INODE,
+  REGION_BITMAP,
+  REGION_DATA,
+  REGION_LOG,
+  REGION_OUTSIDE
+};
+
+const char *region_names[] = {
+  "boot block", "superblock", "inode table", "bitmap", "data", "log", "outside the file system"
+};
+
+// Layout of the file system derived from the superblock.
+// block_shift is log2(BLOCK_SIZE); every byte offset into the image is
+// computed as a 64-bit value from it so images over 4 GB address correctly.
+// region_end[r] is the first block past region r.
+typedef struct _fs_geometry {
+    uint block_shift;
+    uint ninodeblocks;
+    uint data_start;
+    uint64_t region_end[REGION_OUTSIDE];
+} fs_geometry;
+
+// mmapimage is the start of the file system, which sits base bytes into the
+// image file (0 unless it is a partition). mapping and map_length describe
+// the page-aligned mapping that holds it.
 typedef struct _img_pointers {
     char *mmapimage;
+    char *mapping;
+    uint64_t map_length;
+    uint64_t base;
+    int fd;
+    struct superblock *sb;
+    fs_geometry geo;
+    uint64_t *read_blocks;  // one bit per block, set once charged to --io-rate
 } img_pointers;
 
-// Function to check if the bit at a given block address is set in the bitmap
-bool is_bit_set(char *bitmapblocks, uint blockaddr) {
-    char bitarr[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
-    return (bitmapblocks[blockaddr / 8] & bitarr[blockaddr % 8]) != 0;
+// Computes the geometry of the image from its superblock.
+void compute_geometry(fs_geometry *geo, struct superblock *sb) {
+    geo->block_shift = 0;
+    while ((1u << geo->block_shift) < BLOCK_SIZE) {
+        geo->block_shift++;
+    }
+    geo->ninodeblocks = (sb->ninodes / (IPB)) + 1;
+    geo->data_start = geo->ninodeblocks + ((sb->size / (BPB)) + 1) + 2;
+
+    geo->region_end[REGION_BOOT] = 1;
+    geo->region_end[REGION_SUPER] = 2;
+    geo->region_end[REGION_INODE] = 2 + geo->ninodeblocks;
+    geo->region_end[REGION_BITMAP] = geo->data_start;
+    geo->region_end[REGION_DATA] = (uint64_t)geo->data_start + sb->nblocks;
+    geo->region_end[REGION_LOG] = sb->size;
 }
 
-// Check Point 1
-// Function to validate the type of an inode
-void validate_inode_type(struct dinode *inode) {
-   bool is_invalid_inode_type = inode->type != INODE_FILE && inode->type != INODE_DIR && inode->type != INODE_DEV;
+// Classifies a block address into the region of the disk it falls in.
+enum block_region classify_block(fs_geometry *geo, uint address) {
+    if (address < geo->region_end[REGION_BOOT]) return REGION_BOOT;
+    if (address < geo->region_end[REGION_SUPER]) return REGION_SUPER;
+    if (address < geo->region_end[REGION_INODE]) return REGION_INODE;
+    if (address < geo->region_end[REGION_BITMAP]) return REGION_BITMAP;
+    if (address < geo->region_end[REGION_DATA]) return REGION_DATA;
+    if (address < geo->region_end[REGION_LOG]) return REGION_LOG;
+    return REGION_OUTSIDE;
+}
 
-  // Check matched to allowed values
-  if(is_invalid_inode_type) {
-    exit_with_error("bad inode.");
-  }
+// Sanity checks a superblock against the image it was read from.
+// Rejects anything whose layout does not fit in the file so that later
+// passes can trust sb->size, sb->nblocks and sb->ninodes.
+void validate_superblock(struct superblock *sb, off_t image_size) {
+    uint64_t ninodeblocks = (sb->ninodes / (IPB)) + 1;
+    uint64_t nbitmapblocks = (sb->size / (BPB)) + 1;
+    uint64_t data_start = 2 + ninodeblocks + nbitmapblocks;
 
+    if (sb->ninodes < 2 || sb->size < 2) {
+        exit_with_error("bad superblock.");
+    }
+    if ((uint64_t)sb->size * BLOCK_SIZE > (uint64_t)image_size) {
+        exit_with_error("bad superblock.");
+    }
+    if (data_start + sb->nblocks > sb->size) {
+        exit_with_error("bad superblock.");
+    }
 }
 
-// Point 2
-// Function to validate both direct and indirect block addresses in an inode
-void validate_block_addresses(struct superblock *sb, struct dinode *inode, char *mmapimage) {
-    // Validate direct block addresses
-    for (int block_index = 0; block_index < NDIRECT; block_index++) {
-        uint address = inode->addrs[block_index];
-        if (address != 0 && (address < 0 || address >= sb->size)) {
-            exit_with_error("bad direct address in inode.");
-        }
-    }
+uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-    // Validate indirect block addresses
-    uint indirect_block_address = inode->addrs[NDIRECT];
-    if (indirect_block_address == 0) return; // No indirect block
+// Prometheus metrics (--metrics). Counters accumulate across runs: on exit
+// the previous file is read back under a lock, this run is added to it, and
+// the result replaces it through a rename, so a batch of fcheck runs over
+// many images can share one file and a scraper never sees it half written.
+#define METRICS_KEY_LENGTH 160
+#define METRICS_MAX_PHASES 32
+
+typedef struct _metrics_sample {
+    char key[METRICS_KEY_LENGTH];   // metric name and labels
+    double value;
+} metrics_sample;
+
+typedef struct _metrics_family {
+    const char *name;
+    const char *type;
+    const char *help;
+} metrics_family;
+
+const metrics_family metrics_families[] = {
+    { "fcheck_images_checked_total", "counter", "Images checked, by result (error: stopped before a verdict)." },
+    { "fcheck_check_failures_total", "counter", "Failed checks, by the Point of the check that failed." },
+    { "fcheck_phase_seconds", "histogram", "Duration of each phase of the check." },
+    { "fcheck_image_bytes_total", "counter", "Bytes of file system covered by the checks." },
+    { "fcheck_read_bytes_total", "counter", "Bytes the checks caused to be read from storage." },
+    { "fcheck_throughput_bytes_per_second", "gauge", "File system bytes checked per second by the last passing run." },
+    { "fcheck_last_run_timestamp_seconds", "gauge", "Unix time the last run finished." },
+};
+#define METRICS_FAMILIES (sizeof(metrics_families) / sizeof(metrics_families[0]))
+
+const double metrics_buckets[] = { 0.001, 0.01, 0.1, 1, 10, 60 };
+#define METRICS_BUCKETS (sizeof(metrics_buckets) / sizeof(metrics_buckets[0]))
+
+// The Point each check error belongs to; anything else counts as "other".
+const struct {
+    const char *message;
+    uint point;
+} metrics_points[] = {
+    { "bad inode.", 1 },
+    { "bad direct address in inode.", 2 },
+    { "bad indirect address in inode.", 2 },
+    { "root directory does not exist.", 3 },
+    { "directory not properly formatted", 4 },
+    { "address used by inode but marked free in bitmap.", 5 },
+    { "bitmap marks block in use but it is not in use.", 6 },
+    { "direct address used more than once.", 7 },
+    { "indirect address used more than once.", 8 },
+    { "inode marked use but not found in a directory.", 9 },
+    { "inode referred to in directory but marked free.", 10 },
+    { "bad reference count for file.", 11 },
+    { "bad reference count for directory.", 11 },
+    { "directory appears more than once in file system.", 12 },
+};
+
+typedef struct _metrics_state {
+    bool enabled;
+    const char *path;
+    uint64_t start_ns;
+    const char *result;       // ok once the check passes, failed on a reported error
+    char error[256];
+    uint64_t image_bytes;
+    uint nphases;
+    struct {
+        const char *name;
+        uint64_t ns;
+    } phases[METRICS_MAX_PHASES];
+} metrics_state;
+
+metrics_state metrics = { false, NULL, 0, "error", "", 0, 0 };
 
-    if (indirect_block_address >= sb->size || indirect_block_address < 0) {
-        exit_with_error("bad indirect address in inode.");
+void metrics_record_error(const char *error_message) {
+    metrics.result = "failed";
+    snprintf(metrics.error, sizeof(metrics.error), "%s", error_message);
+}
+
+void metrics_phase(const char *name, uint64_t ns) {
+    if (metrics.nphases == METRICS_MAX_PHASES) return;
+    metrics.phases[metrics.nphases].name = name;
+    metrics.phases[metrics.nphases++].ns = ns;
+}
+
+// Returns the sample for key, adding it with value 0 if it is new.
+metrics_sample *metrics_sample_for(metrics_sample **samples, uint *count, const char *key) {
+    for (uint idx = 0; idx < *count; idx++) {
+        if (strcmp((*samples)[idx].key, key) == 0) return &(*samples)[idx];
     }
+    *samples = realloc(*samples, (*count + 1) * sizeof(metrics_sample));
+    metrics_sample *sample = &(*samples)[(*count)++];
+    snprintf(sample->key, sizeof(sample->key), "%s", key);
+    sample->value = 0;
+    return sample;
+}
 
-    uint *indirect_block_ptr = (uint *)(mmapimage + indirect_block_address * BLOCK_SIZE);
-    for (int idx = 0; idx < NINDIRECT; idx++, indirect_block_ptr++) {
-        uint current_block_address = *indirect_block_ptr;
-        if (current_block_address != 0 && (current_block_address >= sb->size || current_block_address < 0)) {
-            exit_with_error("bad indirect address in inode.");
+bool metrics_in_family(const char *key, const metrics_family *family) {
+    size_t length = strlen(family->name);
+    if (strncmp(key, family->name, length) != 0) return false;
+    const char *rest = key + length;
+    if (strcmp(family->type, "histogram") == 0) {
+        const char *suffixes[] = { "_bucket", "_sum", "_count" };
+        for (uint idx = 0; idx < 3; idx++) {
+            size_t suffix = strlen(suffixes[idx]);
+            if (strncmp(rest, suffixes[idx], suffix) == 0) {
+                rest += suffix;
+                break;
+            }
         }
     }
+    return *rest == '\0' || *rest == '{';
 }
 
-// Point 3: Verifies the existence of the root directory and that it references itself as its parent.
-void check_root_directory(struct dinode *root_inode, char *mmapimage) {
-    uint block_address = root_inode->addrs[0];
-    if (block_address == 0) {
-        exit_with_error("root directory does not exist.");
+// Bytes read from storage on behalf of this process, 0 where unknown.
+uint64_t metrics_read_bytes(void) {
+    unsigned long long bytes = 0;
+    char line[128];
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) return 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "read_bytes: %llu", &bytes) == 1) break;
     }
+    fclose(file);
+    return bytes;
+}
 
-    struct dirent *directory_entry = (struct dirent *)(mmapimage + block_address * BLOCK_SIZE);
-    if (strcmp(directory_entry->name, ".") != 0 || directory_entry->inum != 1) {
-        exit_with_error("root directory does not exist.");
-    }
-    directory_entry++;
-    if (strcmp(directory_entry->name, "..") != 0 || directory_entry->inum != 1) {
-        exit_with_error("root directory does not exist.");
+// Adds this run to the metrics file, on exit. A run that passed the check
+// but exits with 1 afterwards, as when --verify-seal or --manifest finds a
+// mismatch or --extract fails, counts as failed and not towards throughput.
+void metrics_write(int status, void *unused) {
+    (void)unused;
+    if (!metrics.enabled) return;
+    metrics.enabled = false;
+    if (status != 0 && strcmp(metrics.result, "ok") == 0) metrics.result = "failed";
+    double elapsed = (clock_ns(CLOCK_MONOTONIC) - metrics.start_ns) / 1e9;
+    size_t length = strlen(metrics.path);
+    char lock_path[length + sizeof(".lock")], temp_path[length + sizeof(".tmp")];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", metrics.path);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", metrics.path);
+
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+        perror(lock_path);
+        return;
     }
-}
 
-// Point 4: Ensures every directory has entries for '.' and '..', pointing to itself and its parent respectively.
-void check_directory_entries(struct dinode *inode, char *mmapimage, int inode_number) {
-    bool found_dot = false, found_dotdot = false;
-    uint block_address;
+    metrics_sample *samples = NULL;
+    uint count = 0;
+    char line[METRICS_KEY_LENGTH + 64], key[METRICS_KEY_LENGTH];
+    FILE *previous = fopen(metrics.path, "r");
+    if (previous != NULL) {
+        while (fgets(line, sizeof(line), previous) != NULL) {
+            char *value = strrchr(line, ' ');
+            if (line[0] == '#' || value == NULL) continue;
+            *value = '\0';
+            metrics_sample_for(&samples, &count, line)->value = strtod(value + 1, NULL);
+        }
+        fclose(previous);
+    }
 
-    for (int dir_idx = 0; dir_idx < NDIRECT; dir_idx++) {
-        block_address = inode->addrs[dir_idx];
-        if (block_address == 0) continue;
+    snprintf(key, sizeof(key), "fcheck_images_checked_total{result=\"%s\"}", metrics.result);
+    metrics_sample_for(&samples, &count, key)->value++;
+    if (strcmp(metrics.result, "failed") == 0) {
+        uint point = 0;
+        for (uint idx = 0; idx < sizeof(metrics_points) / sizeof(metrics_points[0]); idx++) {
+            if (strncmp(metrics.error, metrics_points[idx].message, strlen(metrics_points[idx].message)) == 0) {
+                point = metrics_points[idx].point;
+            }
+        }
+        if (point != 0) {
+            snprintf(key, sizeof(key), "fcheck_check_failures_total{point=\"%u\"}", point);
+        } else {
+            snprintf(key, sizeof(key), "fcheck_check_failures_total{point=\"other\"}");
+        }
+        metrics_sample_for(&samples, &count, key)->value++;
+    }
+    for (uint phase = 0; phase < metrics.nphases; phase++) {
+        const char *name = metrics.phases[phase].name;
+        double seconds = metrics.phases[phase].ns / 1e9;
+        for (uint bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+            snprintf(key, sizeof(key), "fcheck_phase_seconds_bucket{phase=\"%s\",le=\"%g\"}", name, metrics_buckets[bucket]);
+            metrics_sample_for(&samples, &count, key)->value += seconds <= metrics_buckets[bucket];
+        }
+        snprintf(key, sizeof(key), "fcheck_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"}", name);
+        metrics_sample_for(&samples, &count, key)->value++;
+        snprintf(key, sizeof(key), "fcheck_phase_seconds_sum{phase=\"%s\"}", name);
+        metrics_sample_for(&samples, &count, key)->value += seconds;
+        snprintf(key, sizeof(key), "fcheck_phase_seconds_count{phase=\"%s\"}", name);
+        metrics_sample_for(&samples, &count, key)->value++;
+    }
+    metrics_sample_for(&samples, &count, "fcheck_image_bytes_total")->value += metrics.image_bytes;
+    metrics_sample_for(&samples, &count, "fcheck_read_bytes_total")->value += metrics_read_bytes();
+    if (strcmp(metrics.result, "ok") == 0 && elapsed > 0) {
+        metrics_sample_for(&samples, &count, "fcheck_throughput_bytes_per_second")->value = metrics.image_bytes / elapsed;
+    }
+    metrics_sample_for(&samples, &count, "fcheck_last_run_timestamp_seconds")->value = time(NULL);
 
-        struct dirent *directory_entry = (struct dirent *)(mmapimage + block_address * BLOCK_SIZE);
-        int entries_per_block = BSIZE / sizeof(struct dirent);
-        for (int entry_idx = 0; entry_idx < entries_per_block; entry_idx++, directory_entry++) {
-            if (strcmp(directory_entry->name, ".") == 0) {
-                found_dot = true;
-                if (directory_entry->inum != inode_number) {
-                    exit_with_error("directory not properly formatted");
+    FILE *file = fopen(temp_path, "w");
+    if (file != NULL) {
+        for (uint family = 0; family < METRICS_FAMILIES; family++) {
+            fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", metrics_families[family].name, metrics_families[family].help,
+                    metrics_families[family].name, metrics_families[family].type);
+            for (uint idx = 0; idx < count; idx++) {
+                if (metrics_in_family(samples[idx].key, &metrics_families[family])) {
+                    fprintf(file, "%s %.17g\n", samples[idx].key, samples[idx].value);
                 }
-            } else if (strcmp(directory_entry->name, "..") == 0) {
-                found_dotdot = true;
             }
-            if (found_dot && found_dotdot) break;
         }
-        if (found_dot && found_dotdot) break;
     }
-
-    if (!found_dot || !found_dotdot) {
-        exit_with_error("directory not properly formatted.");
+    if (file == NULL || fclose(file) != 0 || rename(temp_path, metrics.path) != 0) {
+        perror(metrics.path);
     }
+    free(samples);
+    close(lock);
 }
 
+// Starts collecting metrics for the file at path.
+void metrics_start(const char *path) {
+    metrics.enabled = true;
+    metrics.path = path;
+    metrics.start_ns = clock_ns(CLOCK_MONOTONIC);
+    on_exit(metrics_write, NULL);
+}
 
-// Function to verify directory structure integrity
-// Point 3: Verifies the existence of the root directory and that it references itself as its parent.
-// Point 4: Ensures every directory has entries for '.' and '..', pointing to itself and its parent respectively.
-void validate_directory_structure(struct dinode *inode, char *mmapimage, int inode_number) {
+// Timeline tracing in Chrome trace-event format (--trace). Each thread
+// appends complete events to its own buffer, registered once on a lock-free
+// list, so recording takes no locks. Buffers are written out on exit.
+typedef struct _trace_event {
+    const char *name;
+    const char *category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t arg_begin;
+    uint64_t arg_end;
+} trace_event;
 
-    bool found_dot = false, found_dotdot = false;
-    uint block_address;
-    
-    for (int dir_idx = 0; dir_idx < NDIRECT; dir_idx++) {
-        block_address = inode->addrs[dir_idx];
-        if (block_address == 0) continue;
+typedef struct _trace_buffer {
+    struct _trace_buffer *next;
+    uint tid;
+    uint count;
+    uint capacity;
+    trace_event *events;
+} trace_buffer;
 
-        struct dirent *directory_entry = (struct dirent *)(mmapimage + block_address * BLOCK_SIZE);
-        int entries_per_block = BSIZE / sizeof(struct dirent);
-        for (int entry_idx = 0; entry_idx < entries_per_block; entry_idx++, directory_entry++) {
-            if (strcmp(directory_entry->name, ".") == 0) {
-                found_dot = true;
-                if (directory_entry->inum != inode_number) {
-                    exit_with_error("directory not properly formatted");
-                }
-            } else if (strcmp(directory_entry->name, "..") == 0) {
-                found_dotdot = true;
-                bool root_dir_issue = (inode_number == 1 && directory_entry->inum != inode_number) ||
-                                      (inode_number != 1 && directory_entry->inum == inode_number);
-                if (root_dir_issue) {
-                    exit_with_error("root directory does not exist.");
-                }
-            }
-            if (found_dot && found_dotdot) break;
+bool trace_enabled = false;
+const char *trace_path = NULL;
+uint64_t trace_origin_ns;
+trace_buffer *trace_buffers = NULL;
+uint trace_next_tid = 1;
+__thread trace_buffer *trace_local = NULL;
+
+trace_buffer *trace_thread_buffer(void) {
+    if (trace_local == NULL) {
+        trace_buffer *buffer = xcalloc(MEM_TRACE, 1, sizeof(trace_buffer));
+        buffer->tid = __atomic_fetch_add(&trace_next_tid, 1, __ATOMIC_RELAXED);
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
         }
-        if (found_dot && found_dotdot) break;
+        trace_local = buffer;
     }
+    return trace_local;
+}
 
-    if (!found_dot || !found_dotdot) {
-        exit_with_error("directory not properly formatted.");
+// Returns the start time of a span, or 0 when neither tracing nor metrics are on.
+static inline uint64_t trace_begin(void) {
+    return trace_enabled || metrics.enabled ? clock_ns(CLOCK_MONOTONIC) : 0;
+}
+
+// Records a span that started at start; begin and end are shown as args.
+// Phase spans also feed the latency histograms of --metrics.
+void trace_span(const char *category, const char *name, uint64_t start, uint64_t arg_begin, uint64_t arg_end) {
+    if (metrics.enabled && strcmp(category, "phase") == 0) {
+        metrics_phase(name, clock_ns(CLOCK_MONOTONIC) - start);
     }
+    if (!trace_enabled) return;
+
+    trace_buffer *buffer = trace_thread_buffer();
+    if (buffer->count == buffer->capacity) {
+        mem_account(MEM_TRACE, (buffer->capacity ? buffer->capacity : 256) * sizeof(trace_event));
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->events = realloc(buffer->events, buffer->capacity * sizeof(trace_event));
+    }
+    trace_event *event = &buffer->events[buffer->count++];
+    event->name = name;
+    event->category = category;
+    event->start_ns = start;
+    event->duration_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    event->arg_begin = arg_begin;
+    event->arg_end = arg_end;
 }
 
-// Point 5
-// Function to ensure that all addresses used by an inode are marked as used in the bitmap
-void validate_bitmap_addr(char *bitmapblocks, struct dinode *inode, char *mmapimage) {
-    for (int idx = 0; idx <= NDIRECT; idx++) {
-        uint address = inode->addrs[idx];
-        if (address != 0 && !is_bit_set(bitmapblocks, address)) {
-            exit_with_error("address used by inode but marked free in bitmap.");
+// Writes s as a JSON string. Span names can be user input, such as the
+// paths of --delta files.
+void trace_write_string(FILE *file, const char *s) {
+    fputc('"', file);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
         }
+    }
+    fputc('"', file);
+}
 
-        // Special handling for indirect address
-        if (idx == NDIRECT) {
-            uint *indirect_block = (uint *)(mmapimage + address * BLOCK_SIZE);
-            for (int indirect_idx = 0; indirect_idx < NINDIRECT; indirect_idx++) {
-                uint indirect_address = indirect_block[indirect_idx];
-                if (indirect_address != 0 && !is_bit_set(bitmapblocks, indirect_address)) {
-                    exit_with_error("address used by inode but marked free in bitmap.");
-                }
-            }
+void trace_write(void) {
+    if (!trace_enabled) return;
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL) {
+        perror(trace_path);
+        return;
+    }
+
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (trace_buffer *buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                first ? "" : ",", buffer->tid, buffer->tid == 1 ? "main" : "worker", buffer->tid);
+        first = false;
+        for (uint idx = 0; idx < buffer->count; idx++) {
+            trace_event *event = &buffer->events[idx];
+            fprintf(file, ",\n{\"name\":");
+            trace_write_string(file, event->name);
+            fprintf(file, ",\"cat\":");
+            trace_write_string(file, event->category);
+            fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"begin\":%llu,\"end\":%llu}}",
+                    buffer->tid,
+                    (event->start_ns - trace_origin_ns) / 1e3, event->duration_ns / 1e3,
+                    (unsigned long long)event->arg_begin, (unsigned long long)event->arg_end);
         }
     }
+    fprintf(file, "\n]}\n");
+    fclose(file);
 }
 
-// This function performs a series of checks on each inode as per the specified points 1 to 5.
-// It iterates through each inode to ensure they adhere to the defined filesystem integrity points.
-void validate_inodes(char *inodeblocks, char *bitmapblocks, char *mmapimage, struct superblock *sb) {
-    struct dinode *current_inode = (struct dinode *)inodeblocks;
+// Starts tracing; the trace is written on exit, including error exits.
+void trace_start(const char *path) {
+    trace_enabled = true;
+    trace_path = path;
+    trace_origin_ns = clock_ns(CLOCK_MONOTONIC);
+    trace_thread_buffer();
+    atexit(trace_write);
+}
 
-    for (int inode_index = 0; inode_index < sb->ninodes; inode_index++, current_inode++) {
-        if (current_inode->type == 0) {
-            // Skip processing for unallocated (free) inodes
-            continue;
-        }
+// Throttling for runs on shared hosts. Block reads are paced by a token
+// bucket shared by all threads, and each thread sleeps whenever its CPU
+// time exceeds cpu_share of the wall time since its last checkpoint.
+// A block is charged the first time it is read; passes and shards that
+// come back to it find it in the image's read_blocks and do not pay again.
+typedef struct _throttle_state {
+    bool active;
+    uint64_t io_rate;       // bytes per second, 0 for unlimited
+    uint cpu_share;         // percent of one CPU per thread, 0 for unlimited
+    uint64_t start_ns;
+    uint64_t bytes_charged;
+    uint64_t slept_ns;
+} throttle_state;
 
-        // Point 1: Validate inode type
-        validate_inode_type(current_inode);
+throttle_state throttle = { false, 0, 0, 0, 0, 0 };
 
-        // Point 2: Validate direct and indirect block addresses
-        validate_block_addresses(sb, current_inode, mmapimage);
+__thread uint64_t throttle_cpu_mark_ns;
+__thread uint64_t throttle_wall_mark_ns;
+__thread uint throttle_calls;
 
-        // Point 3 and 4: Validate directory structure
-        if (inode_index == 1) { // Root directory specific check
-            if (current_inode->type != INODE_DIR) {
-                exit_with_error("root directory does not exist.");
-            }
-            validate_directory_structure(current_inode, mmapimage, 1);
-        } else if (current_inode->type == INODE_DIR) {
-            validate_directory_structure(current_inode, mmapimage, inode_index);
+void throttle_sleep(uint64_t ns) {
+    struct timespec delay = { ns / 1000000000ull, ns % 1000000000ull };
+    uint64_t span = trace_begin();
+    nanosleep(&delay, NULL);
+    trace_span("io", "throttle wait", span, ns, 0);
+    __atomic_fetch_add(&throttle.slept_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Charges bytes read against the token bucket and the CPU budget.
+// Passes that read no image data call it with 0 as a CPU checkpoint.
+void throttle_read(uint64_t bytes) {
+    if (throttle.io_rate != 0) {
+        uint64_t charged = __atomic_add_fetch(&throttle.bytes_charged, bytes, __ATOMIC_RELAXED);
+        uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - throttle.start_ns;
+        // One second of burst is allowed before reads are delayed
+        uint64_t allowed = throttle.io_rate + (uint64_t)((double)throttle.io_rate * elapsed / 1e9);
+        if (charged > allowed) {
+            throttle_sleep((uint64_t)((double)(charged - allowed) * 1e9 / throttle.io_rate));
         }
+    }
 
-        // Point 5: Validate bitmap address
-        validate_bitmap_addr(bitmapblocks, current_inode, mmapimage);
+    // CPU time is sampled every 256 reads to keep the check cheap
+    if (throttle.cpu_share != 0 && (throttle_calls++ & 255) == 0) {
+        uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+        if (throttle_wall_mark_ns != 0) {
+            uint64_t budget_wall = (cpu - throttle_cpu_mark_ns) * 100 / throttle.cpu_share;
+            uint64_t spent_wall = wall - throttle_wall_mark_ns;
+            if (budget_wall > spent_wall) {
+                throttle_sleep(budget_wall - spent_wall);
+                wall = clock_ns(CLOCK_MONOTONIC);
+            }
+        }
+        throttle_cpu_mark_ns = cpu;
+        throttle_wall_mark_ns = wall;
     }
 }
 
+// Reports how much the throttle delayed the run, on exit.
+void throttle_report(void) {
+    uint64_t total = clock_ns(CLOCK_MONOTONIC) - throttle.start_ns;
+    uint64_t slept = __atomic_load_n(&throttle.slept_ns, __ATOMIC_RELAXED);
+    fprintf(stderr, "throttle: %.3f s total, %.3f s spent waiting (%.0f%% slower than unthrottled), %llu bytes charged\n",
+            total / 1e9, slept / 1e9, total > slept ? 100.0 * slept / (total - slept) : 0.0,
+            (unsigned long long)__atomic_load_n(&throttle.bytes_charged, __ATOMIC_RELAXED));
+}
 
-// Point 6
-// This function identifies the data blocks actively used by a given inode.
-// It marks both direct and indirect blocks as used in the used_dbs array.
-void get_active_data_blocks(struct dinode *inode, int *used_blocks_array, char *mmapimage, uint starting_block){
-    uint address;
-    
-    // Looping through each address in the inode
-    for (int addr_idx = 0; addr_idx <= NDIRECT; addr_idx++) {
-        address = inode->addrs[addr_idx];
-        if (address == 0) continue; // Skipping empty addresses
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
 
-        // Marking the block as used
-        used_blocks_array[address - starting_block] = 1;
+// Enables throttling, dropping the process to the lowest best-effort io priority.
+void throttle_start(uint64_t io_rate, uint cpu_share) {
+    throttle.active = true;
+    throttle.io_rate = io_rate;
+    throttle.cpu_share = cpu_share;
+    throttle.start_ns = clock_ns(CLOCK_MONOTONIC);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7);
+    atexit(throttle_report);
+}
 
-        // Processing indirect blocks
-        if (addr_idx == NDIRECT) {
-            uint *indirect_block = (uint *)(mmapimage + address * BLOCK_SIZE);
-            for (int indirect_idx = 0; indirect_idx < NINDIRECT; indirect_idx++) {
-                uint indirect_address = indirect_block[indirect_idx];
-                if (indirect_address != 0) {
-                    used_blocks_array[indirect_address - starting_block] = 1;
-                }
-            }
-        }
-    }
+// Charges a block against the budget on its first read. Later reads only
+// serve as CPU checkpoints.
+void throttle_block(uint64_t *read_blocks, uint address) {
+    uint64_t *word = &read_blocks[address >> 6];
+    uint64_t bit = 1ull << (address & 63);
+    bool charged = (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        || (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+    throttle_read(charged ? 0 : BLOCK_SIZE);
 }
 
-// Point 6
-// Validates that all blocks marked as used in the bitmap are indeed used by some inode.
-void verify_bitmap_usage(char *inodeblocks, char *bitmapblocks, char *mmapimage, struct superblock *sb, uint start_block) {
-    struct dinode *current_inode = (struct dinode *)inodeblocks;
-    int blocks_in_use[sb->nblocks];
-    memset(blocks_in_use, 0, sizeof(int) * sb->nblocks);
+// Returns a pointer to the given block inside the mapped image.
+// This is the single block source of the checker, so throttling hooks here.
+static inline char *block_addr(img_pointers *image, uint address) {
+    if (image->read_blocks != NULL) throttle_block(image->read_blocks, address);
+    return image->mmapimage + ((uint64_t)address << image->geo.block_shift);
+}
 
-    // Iterating through inodes to flag used blocks
-    for (int inode_idx = 0; inode_idx < sb->ninodes; inode_idx++, current_inode++) {
-        if (current_inode->type == 0) continue; // Skip unused inodes
+// Number of worker threads used by the parallel passes. 0 means one per CPU.
+int worker_threads = 0;
 
-        get_active_data_blocks(current_inode, blocks_in_use, mmapimage, start_block);
-    }
+int worker_count(void) {
+    int nthreads = worker_threads > 0 ? worker_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return nthreads < 1 ? 1 : nthreads;
+}
+
+#define MAX_NUMA_NODES 64
+
+// CPUs of each NUMA node, read from sysfs on first use and limited to the
+// CPUs the process may run on, so a run confined to one socket (taskset,
+// cpusets) counts one node. Workers are pinned so that consecutive worker
+// indexes share a node; nnodes <= 1 disables it.
+typedef struct _numa_topology {
+    int nnodes;
+    cpu_set_t cpus[MAX_NUMA_NODES];
+} numa_topology;
 
-    // Verifying bitmap against the block usage array
-    for (int block_idx = 0; block_idx < sb->nblocks; block_idx++) {
-        uint actual_block_addr = block_idx + start_block;
-        if (blocks_in_use[block_idx] == 0 && is_bit_set(bitmapblocks, actual_block_addr)) {
-            exit_with_error("bitmap marks block in use but it is not in use.");
+numa_topology numa = { -1 };
+pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+void numa_discover(void) {
+    char path[64], list[4096];
+    cpu_set_t allowed;
+    bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    numa.nnodes = 0;
+
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) continue;
+        char *ok = fgets(list, sizeof(list), file);
+        fclose(file);
+        if (ok == NULL) continue;
+
+        // cpulist is a comma separated list of CPUs and ranges, e.g. "0-3,8-11"
+        cpu_set_t *cpus = &numa.cpus[numa.nnodes];
+        CPU_ZERO(cpus);
+        for (char *part = strtok(list, ",\n"); part != NULL; part = strtok(NULL, ",\n")) {
+            int first, last;
+            int fields = sscanf(part, "%d-%d", &first, &last);
+            if (fields < 1) continue;
+            if (fields == 1) last = first;
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, cpus);
         }
+        if (restricted) CPU_AND(cpus, cpus, &allowed);
+        if (CPU_COUNT(cpus) > 0) numa.nnodes++;
     }
 }
 
-// Point 7
-// This function tallies the occurrences of direct block addresses used by an inode.
-void tally_direct_block_usage(struct dinode *target_inode, uint *direct_usage_array, uint start_block) {
-    uint address;
+// Pins the calling worker to the node that owns its share of the work.
+void numa_pin_worker(int worker, int nworkers) {
+    pthread_once(&numa_once, numa_discover);
+    if (numa.nnodes <= 1) return;
 
-    // Looping through the direct addresses in the inode
-    for (int idx = 0; idx < NDIRECT; idx++) {
-        address = target_inode->addrs[idx];
-        if (address == 0) continue; // Skip if the address is not in use
+    int node = (int)((int64_t)worker * numa.nnodes / nworkers);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa.cpus[node]);
+}
 
-        // Incrementing the usage count for each direct block address
-        direct_usage_array[address - start_block]++;
+typedef void (*range_fn)(void *ctx, uint begin, uint end);
+
+typedef struct _parallel_job {
+    const char *name;
+    range_fn fn;
+    void *ctx;
+    uint count;
+    uint grain;
+    uint next;
+    int nworkers;
+} parallel_job;
+
+typedef struct _parallel_worker_arg {
+    parallel_job *job;
+    int index;
+    uint begin;   // fixed slice for parallel_shards
+    uint end;
+} parallel_worker_arg;
+
+void *parallel_worker(void *arg) {
+    parallel_worker_arg *worker = arg;
+    parallel_job *job = worker->job;
+    if (worker->index > 0) numa_pin_worker(worker->index, job->nworkers);
+
+    for (;;) {
+        uint begin = __atomic_fetch_add(&job->next, job->grain, __ATOMIC_RELAXED);
+        if (begin >= job->count) break;
+        uint end = job->count - begin < job->grain ? job->count : begin + job->grain;
+        uint64_t span = trace_begin();
+        job->fn(job->ctx, begin, end);
+        trace_span("chunk", job->name, span, begin, end);
     }
+    return NULL;
 }
 
-// Point 8 
-// This function accounts for the usage of indirect block addresses within an inode.
-void count_indirect_block_usage(struct dinode *target_inode, uint *indirect_usage_array, char *fs_image, uint start_block) {
-    uint indirect_block_address = target_inode->addrs[NDIRECT];
+// Runs fn over [0, count) split into chunks of grain items, handed out
+// dynamically to the worker threads. The calling thread works as well.
+// name labels the chunks in --trace output.
+void parallel_for(const char *name, uint count, uint grain, range_fn fn, void *ctx) {
+    parallel_job job = { name, fn, ctx, count, grain > 0 ? grain : 1, 0, worker_count() };
+    if ((uint)job.nworkers > count / job.grain + 1) job.nworkers = count / job.grain + 1;
 
-    if (indirect_block_address == 0) return; // No indirect block present
+    pthread_t threads[job.nworkers];
+    parallel_worker_arg args[job.nworkers];
+    int started = 0;
+    for (int t = 0; t < job.nworkers; t++) {
+        args[t] = (parallel_worker_arg){ &job, t, 0, 0 };
+    }
+    for (int t = 1; t < job.nworkers; t++) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, &args[t]) != 0) break;
+        started++;
+    }
+    parallel_worker(&args[0]);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
 
-    // Accessing the array of indirect block addresses
-    uint *indirect_block_ptr = (uint *)(fs_image + indirect_block_address * BLOCK_SIZE);
+void *parallel_shard_worker(void *arg) {
+    parallel_worker_arg *worker = arg;
+    parallel_job *job = worker->job;
+    numa_pin_worker(worker->index, job->nworkers);
 
-    // Iterating over the indirect block addresses
-    for (int idx = 0; idx < NINDIRECT; idx++) {
-        uint current_address = indirect_block_ptr[idx];
-        if (current_address != 0) {
-            // Incrementing the usage count for each indirect block address
-            indirect_usage_array[current_address - start_block]++;
-        }
-    }
+    uint64_t span = trace_begin();
+    job->fn(job->ctx, worker->begin, worker->end);
+    trace_span("chunk", job->name, span, worker->begin, worker->end);
+    return NULL;
 }
 
-// Point 7 and 8
-// Function to ensure that each block address within in-use inodes is uniquely used.
-void validate_block_address_uniqueness(char *inodeblocks, char *fs_image, struct superblock *sb, uint start_block) {
-    struct dinode *current_inode = (struct dinode *)inodeblocks;
-    
-    // Arrays to track the usage count of direct and indirect addresses.
-    uint direct_usage_counts[sb->nblocks];
-    uint indirect_usage_counts[sb->nblocks];
-    memset(direct_usage_counts, 0, sizeof(uint) * sb->nblocks);
-    memset(indirect_usage_counts, 0, sizeof(uint) * sb->nblocks);
+// Number of shards parallel_shards splits count items into.
+uint shard_count(uint count) {
+    uint nshards = (uint)worker_count();
+    if (nshards > count) nshards = count > 0 ? count : 1;
+    return nshards;
+}
+
+// First item of shard index of count items split nshards ways.
+static inline uint shard_begin(uint count, uint index, uint nshards) {
+    return (uint)((uint64_t)count * index / nshards);
+}
 
-    // Iterating through each inode to accumulate address usage
-    for (int inode_idx = 0; inode_idx < sb->ninodes; inode_idx++, current_inode++) {
-        if (current_inode->type == 0) continue; // Skip unused inodes
+// Splits [0, count) into one contiguous shard per worker. Shard i always
+// runs on the node of worker i, so a shard that first-touches its slice of
+// an array keeps that slice in node-local memory for the whole pass.
+void parallel_shards(const char *name, uint count, range_fn fn, void *ctx) {
+    parallel_job job = { name, fn, ctx, count, 1, 0, (int)shard_count(count) };
 
-        // Tallying the usage of direct and indirect block addresses
-        tally_direct_block_usage(current_inode, direct_usage_counts, start_block);
-        count_indirect_block_usage(current_inode, indirect_usage_counts, fs_image, start_block);
+    if (job.nworkers == 1) {
+        uint64_t span = trace_begin();
+        fn(ctx, 0, count);
+        trace_span("chunk", name, span, 0, count);
+        return;
     }
 
-    // Verifying that each address is used only once
-    for (int block_idx = 0; block_idx < sb->nblocks; block_idx++) {
-        if (direct_usage_counts[block_idx] > 1) {
-            exit_with_error("direct address used more than once.");
-        }
-        if (indirect_usage_counts[block_idx] > 1) {
-            exit_with_error("indirect address used more than once.");
+    pthread_t threads[job.nworkers];
+    parallel_worker_arg args[job.nworkers];
+    bool started[job.nworkers];
+    for (int t = 0; t < job.nworkers; t++) {
+        args[t] = (parallel_worker_arg){ &job, t, shard_begin(count, t, job.nworkers),
+                                         shard_begin(count, t + 1, job.nworkers) };
+        started[t] = pthread_create(&threads[t], NULL, parallel_shard_worker, &args[t]) == 0;
+    }
+    for (int t = 0; t < job.nworkers; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            fn(ctx, args[t].begin, args[t].end);
         }
     }
 }
 
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
 
-//function for point 9, 10, 11, 12
-//iterate through all directories and count for inodemap (how many times each inode number has been refered by directory).
-void scan_directory_entries(char *inodeblocks, img_pointers *image, struct dinode *rootinode, int *inodemap) {
-    int initialSize = 100; // Initial stack size, adjust as needed
-    struct dinode **stack = malloc(initialSize * sizeof(struct dinode *));
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
 
-    int stackSize = initialSize; 
-    int stackTop = 0;
+// Fast non-cryptographic 64-bit hash, eight bytes per step.
+// Chaining calls through seed hashes a byte stream incrementally.
+uint64_t hash_bytes(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *bytes = data;
+    uint64_t hash = seed ^ (length * HASH_PRIME3);
 
-    // Push the root directory onto the stack
-    stack[stackTop++] = rootinode;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash ^= rotl64(word * HASH_PRIME2, 31) * HASH_PRIME1;
+        hash = rotl64(hash, 27) * HASH_PRIME1 + HASH_PRIME3;
+    }
+    for (; length > 0; length--, bytes++) {
+        hash ^= *bytes * HASH_PRIME3;
+        hash = rotl64(hash, 11) * HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Decodes the block map of an inode into its logical block addresses.
+// addresses must hold MAXFILE entries; unused slots are left as 0.
+// Returns the number of logical slots the inode can address.
+uint decode_block_map(img_pointers *image, struct dinode *inode, uint *addresses) {
+    memcpy(addresses, inode->addrs, NDIRECT * sizeof(uint));
+
+    uint indirect_block_address = inode->addrs[NDIRECT];
+    if (indirect_block_address == 0) {
+        memset(addresses + NDIRECT, 0, NINDIRECT * sizeof(uint));
+        return NDIRECT;
+    }
+
+    memcpy(addresses + NDIRECT, block_addr(image, indirect_block_address), NINDIRECT * sizeof(uint));
+    return MAXFILE;
+}
+
+#define VERDICT_CACHE_MAGIC "FCKCACH2"
+
+// Kinds of cached verdicts, mixed into the key so equal bytes checked under
+// different rules never collide.
+enum verdict_kind {
+  VERDICT_INODE_BLOCK = 1,  // Points 1 and 2 (direct and indirect slot) for IPB inodes
+  VERDICT_INDIRECT_BLOCK,   // Point 2 for the addresses an indirect block lists
+  VERDICT_DIRECTORY         // Point 4 for a directory inode and its direct blocks
+};
+
+// A 128-bit key: two independent hashes of the same bytes. Both zero marks
+// an empty slot.
+typedef struct _verdict_key {
+    uint64_t low;
+    uint64_t high;
+} verdict_key;
+
+// Layout of the cache file: this header, then count keys. The salt is drawn
+// at random when the file is created and keys every hash, so the keys of one
+// file cannot be predicted from an image alone. A file whose checksum or
+// length does not match is discarded.
+typedef struct _verdict_cache_header {
+    char magic[8];
+    uint64_t salt;
+    uint64_t count;
+    uint checksum;        // CRC32C of the keys
+    uint reserved;
+} verdict_cache_header;
+
+// Content-addressed cache of local check results shared across runs.
+// A key is the hash of the checked bytes seeded with the file's salt and
+// the image geometry, so a hit means the same bytes already passed the same
+// local checks. Global reconciliation (Points 5 to 12) is always recomputed.
+typedef struct _verdict_cache {
+    const char *path;
+    uint64_t salt;
+    uint64_t seed[2];
+    verdict_key *slots;   // open addressing
+    uint64_t capacity;    // power of two
+    uint64_t count;
+    verdict_key *pending; // keys learned in this run, appended on success
+    uint64_t npending;
+    uint64_t pending_capacity;
+} verdict_cache;
+
+verdict_cache *active_cache = NULL;
+
+verdict_key verdict_key_start(verdict_cache *cache, uint64_t tweak) {
+    return (verdict_key){ cache->seed[0] ^ tweak, cache->seed[1] ^ tweak };
+}
+
+void verdict_key_add(verdict_key *key, const void *data, size_t length) {
+    key->low = hash_bytes(data, length, key->low);
+    key->high = hash_bytes(data, length, key->high);
+}
+
+verdict_key verdict_key_finish(verdict_key key) {
+    if (key.low == 0 && key.high == 0) key.low = 1;
+    return key;
+}
+
+bool verdict_key_empty(verdict_key key) {
+    return key.low == 0 && key.high == 0;
+}
+
+bool verdict_key_equal(verdict_key a, verdict_key b) {
+    return a.low == b.low && a.high == b.high;
+}
+
+bool verdict_cache_insert(verdict_cache *cache, verdict_key key) {
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        uint64_t old_capacity = cache->capacity;
+        verdict_key *old_slots = cache->slots;
+        cache->capacity = old_capacity ? old_capacity * 2 : 1024;
+        cache->slots = xcalloc(MEM_VERDICT_CACHE, cache->capacity, sizeof(verdict_key));
+        cache->count = 0;
+        for (uint64_t idx = 0; idx < old_capacity; idx++) {
+            if (!verdict_key_empty(old_slots[idx])) verdict_cache_insert(cache, old_slots[idx]);
+        }
+        free(old_slots);
+    }
+
+    uint64_t slot = key.low & (cache->capacity - 1);
+    while (!verdict_key_empty(cache->slots[slot])) {
+        if (verdict_key_equal(cache->slots[slot], key)) return false;
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    cache->slots[slot] = key;
+    cache->count++;
+    return true;
+}
+
+bool verdict_cache_contains(verdict_cache *cache, verdict_key key) {
+    if (cache->capacity == 0) return false;
+    uint64_t slot = key.low & (cache->capacity - 1);
+    while (!verdict_key_empty(cache->slots[slot])) {
+        if (verdict_key_equal(cache->slots[slot], key)) return true;
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    return false;
+}
+
+// Records that the bytes behind key passed their local checks. Callers
+// remember a key only once every check it stands for has passed.
+void verdict_cache_remember(verdict_cache *cache, verdict_key key) {
+    if (!verdict_cache_insert(cache, key)) return;
+    if (cache->npending == cache->pending_capacity) {
+        mem_account(MEM_VERDICT_CACHE, (cache->pending_capacity ? cache->pending_capacity : 1024) * sizeof(verdict_key));
+        cache->pending_capacity = cache->pending_capacity ? cache->pending_capacity * 2 : 1024;
+        cache->pending = realloc(cache->pending, cache->pending_capacity * sizeof(verdict_key));
+    }
+    cache->pending[cache->npending++] = key;
+}
+
+// Reads and verifies the cache file behind fd. Returns false for a file that
+// is empty, of another format, truncated or fails its checksum. On success
+// *keys holds header->count keys, which the caller frees.
+bool verdict_cache_read(int fd, verdict_cache_header *header, verdict_key **keys) {
+    struct stat cache_stat;
+    *keys = NULL;
+    if (fstat(fd, &cache_stat) < 0 || cache_stat.st_size < (off_t)sizeof(*header)) return false;
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header)) return false;
+    if (memcmp(header->magic, VERDICT_CACHE_MAGIC, 8) != 0) return false;
+    if (header->count > ((uint64_t)cache_stat.st_size - sizeof(*header)) / sizeof(verdict_key) ||
+        sizeof(*header) + header->count * sizeof(verdict_key) != (uint64_t)cache_stat.st_size) {
+        return false;
+    }
+
+    size_t length = header->count * sizeof(verdict_key);
+    *keys = malloc(length ? length : 1);
+    if (*keys == NULL || pread(fd, *keys, length, sizeof(*header)) != (ssize_t)length ||
+        crc32c(0, (unsigned char *)*keys, length) != header->checksum) {
+        free(*keys);
+        *keys = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Loads the cache file if it exists and is intact. The seeds bind every key
+// to the file's salt and to the geometry, since Point 2 depends on where the
+// data region lies.
+void verdict_cache_open(verdict_cache *cache, const char *path, struct superblock *sb) {
+    uint64_t geometry[3] = { sb->size, sb->nblocks, sb->ninodes };
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    crc32c_init();
+
+    verdict_cache_header header;
+    verdict_key *keys = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat cache_stat;
+        flock(fd, LOCK_SH);
+        if (verdict_cache_read(fd, &header, &keys)) {
+            cache->salt = header.salt;
+            for (uint64_t idx = 0; idx < header.count; idx++) {
+                if (!verdict_key_empty(keys[idx])) verdict_cache_insert(cache, keys[idx]);
+            }
+            free(keys);
+        } else if (fstat(fd, &cache_stat) == 0 && cache_stat.st_size > 0) {
+            fprintf(stderr, "verdict cache: %s is damaged, starting over\n", path);
+        }
+        close(fd);
+    }
+
+    if (cache->salt == 0 && getentropy(&cache->salt, sizeof(cache->salt)) < 0) {
+        cache->salt = (uint64_t)time(NULL) * HASH_PRIME1 ^ (uint64_t)getpid();
+    }
+    cache->seed[0] = hash_bytes(geometry, sizeof(geometry), cache->salt ^ BLOCK_SIZE);
+    cache->seed[1] = hash_bytes(geometry, sizeof(geometry), rotl64(cache->salt, 32) ^ HASH_PRIME2);
+}
+
+// Appends the keys learned in this run under an exclusive lock, so batch
+// runs sharing one cache file do not interleave records. The keys go first
+// and the header last, so a run cut short leaves a file that fails its
+// length check rather than one that passes with missing keys. A damaged
+// file is rewritten; a file created anew by another run since this one
+// opened it has another salt, and this run's keys are dropped.
+void verdict_cache_save(verdict_cache *cache) {
+    if (cache->npending == 0) return;
+
+    int fd = open(cache->path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        perror("verdict cache");
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    verdict_cache_header header;
+    verdict_key *keys;
+    if (verdict_cache_read(fd, &header, &keys)) {
+        free(keys);
+        if (header.salt != cache->salt) {
+            close(fd);
+            return;
+        }
+    } else {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, VERDICT_CACHE_MAGIC, 8);
+        header.salt = cache->salt;
+        if (ftruncate(fd, 0) < 0) {
+            perror("verdict cache");
+            close(fd);
+            return;
+        }
+    }
+
+    size_t length = cache->npending * sizeof(verdict_key);
+    off_t end = sizeof(header) + header.count * sizeof(verdict_key);
+    header.checksum = crc32c(header.checksum, (unsigned char *)cache->pending, length);
+    header.count += cache->npending;
+    if (pwrite(fd, cache->pending, length, end) != (ssize_t)length ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("verdict cache");
+    }
+    close(fd);
+}
+
+verdict_key verdict_block_key(verdict_cache *cache, enum verdict_kind kind, char *block) {
+    verdict_key key = verdict_key_start(cache, kind);
+    verdict_key_add(&key, block, BLOCK_SIZE);
+    return verdict_key_finish(key);
+}
+
+// Columnar export (--export). Each column of each table is a file of
+// fixed-width little-endian values written through a large stdio buffer as
+// the inode scan and the directory traversal go, so downstream tools can
+// mmap a column and index it by row. Files are renamed into place only
+// after the check passes, and a schema file lists columns and row counts.
+enum export_table { EXPORT_INODES, EXPORT_DIRENTS, EXPORT_EXTENTS, EXPORT_TABLES };
+
+enum export_column {
+    EXPORT_INODE_INUM, EXPORT_INODE_TYPE, EXPORT_INODE_NLINK, EXPORT_INODE_SIZE,
+    EXPORT_DIRENT_PARENT, EXPORT_DIRENT_INUM, EXPORT_DIRENT_NAME,
+    EXPORT_EXTENT_INUM, EXPORT_EXTENT_START, EXPORT_EXTENT_LENGTH,
+    EXPORT_COLUMNS
+};
+
+const struct {
+    const char *name;
+    enum export_table table;
+    uint width;
+} export_columns[EXPORT_COLUMNS] = {
+    { "inodes.inum", EXPORT_INODES, 4 },
+    { "inodes.type", EXPORT_INODES, 2 },
+    { "inodes.nlink", EXPORT_INODES, 2 },
+    { "inodes.size", EXPORT_INODES, 4 },
+    { "dirents.parent", EXPORT_DIRENTS, 4 },
+    { "dirents.inum", EXPORT_DIRENTS, 4 },
+    { "dirents.name", EXPORT_DIRENTS, DIRSIZ },
+    { "extents.inum", EXPORT_EXTENTS, 4 },
+    { "extents.start", EXPORT_EXTENTS, 4 },
+    { "extents.length", EXPORT_EXTENTS, 4 },
+};
+
+const char *export_table_names[EXPORT_TABLES] = { "inodes", "dirents", "extents" };
+
+#define EXPORT_BUFFER_SIZE (256 * 1024)
+
+typedef struct _export_state {
+    const char *dir;
+    FILE *files[EXPORT_COLUMNS];
+    char *buffers[EXPORT_COLUMNS];   // stdio buffers, freed once their file is closed
+    uint64_t rows[EXPORT_TABLES];
+} export_state;
+
+export_state *active_export = NULL;
+
+// The export whose columns are still temporary, removed if the run exits
+// before export_finish moves them into place
+export_state *pending_export = NULL;
+
+void export_failed(const char *path) {
+    fprintf(stderr, "export failed: %s: %s\n", path, strerror(errno));
+    exit(1);
+}
+
+// Path of a column file, with ".tmp" appended until the export finishes.
+void export_path(export_state *state, const char *name, bool temporary, char *path, size_t size) {
+    snprintf(path, size, "%s/%s%s", state->dir, name, temporary ? ".tmp" : "");
+}
+
+// Removes the temporary columns of an unfinished export, on exit.
+void export_discard(void) {
+    char path[4096];
+
+    if (pending_export == NULL) return;
+    for (int column = 0; column < EXPORT_COLUMNS; column++) {
+        if (pending_export->files[column] != NULL) fclose(pending_export->files[column]);
+        free(pending_export->buffers[column]);
+        pending_export->buffers[column] = NULL;
+        export_path(pending_export, export_columns[column].name, true, path, sizeof(path));
+        unlink(path);
+    }
+    pending_export = NULL;
+}
+
+void export_open(export_state *state, const char *dir) {
+    char path[4096];
+
+    memset(state, 0, sizeof(*state));
+    state->dir = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) export_failed(dir);
+    pending_export = state;
+    atexit(export_discard);
+    for (int column = 0; column < EXPORT_COLUMNS; column++) {
+        export_path(state, export_columns[column].name, true, path, sizeof(path));
+        state->files[column] = fopen(path, "wb");
+        if (state->files[column] == NULL) export_failed(path);
+        state->buffers[column] = xmalloc_untouched(MEM_EXPORT, EXPORT_BUFFER_SIZE, 1);
+        setvbuf(state->files[column], state->buffers[column], _IOFBF, EXPORT_BUFFER_SIZE);
+    }
+}
+
+static inline void export_value(export_state *state, enum export_column column, const void *value) {
+    fwrite(value, export_columns[column].width, 1, state->files[column]);
+}
+
+// Records an in-use inode and its runs of contiguous data blocks.
+void export_inode(export_state *state, img_pointers *image, uint inum, struct dinode *inode) {
+    uint addresses[MAXFILE];
+    uint nslots = decode_block_map(image, inode, addresses);
+    uint size = inode->size;
+
+    export_value(state, EXPORT_INODE_INUM, &inum);
+    export_value(state, EXPORT_INODE_TYPE, &inode->type);
+    export_value(state, EXPORT_INODE_NLINK, &inode->nlink);
+    export_value(state, EXPORT_INODE_SIZE, &size);
+    state->rows[EXPORT_INODES]++;
+
+    for (uint slot = 0; slot < nslots;) {
+        if (addresses[slot] == 0) {
+            slot++;
+            continue;
+        }
+        uint start = addresses[slot], length = 1;
+        while (slot + length < nslots && addresses[slot + length] == start + length) length++;
+        export_value(state, EXPORT_EXTENT_INUM, &inum);
+        export_value(state, EXPORT_EXTENT_START, &start);
+        export_value(state, EXPORT_EXTENT_LENGTH, &length);
+        state->rows[EXPORT_EXTENTS]++;
+        slot += length;
+    }
+}
+
+void export_dirent(export_state *state, uint parent, struct dirent *entry) {
+    uint inum = entry->inum;
+    export_value(state, EXPORT_DIRENT_PARENT, &parent);
+    export_value(state, EXPORT_DIRENT_INUM, &inum);
+    export_value(state, EXPORT_DIRENT_NAME, entry->name);
+    state->rows[EXPORT_DIRENTS]++;
+}
+
+// Flushes the columns, moves them into place and writes the schema.
+void export_finish(export_state *state) {
+    char temporary[4096], final[4096];
+
+    for (int column = 0; column < EXPORT_COLUMNS; column++) {
+        export_path(state, export_columns[column].name, true, temporary, sizeof(temporary));
+        export_path(state, export_columns[column].name, false, final, sizeof(final));
+        int closed = fclose(state->files[column]);
+        state->files[column] = NULL;
+        free(state->buffers[column]);
+        state->buffers[column] = NULL;
+        if (closed != 0) export_failed(temporary);
+        if (rename(temporary, final) < 0) export_failed(final);
+    }
+    pending_export = NULL;
+
+    export_path(state, "schema", false, final, sizeof(final));
+    FILE *schema = fopen(final, "w");
+    if (schema == NULL) export_failed(final);
+    for (int column = 0; column < EXPORT_COLUMNS; column++) {
+        enum export_table table = export_columns[column].table;
+        fprintf(schema, "%s %u %llu\n", export_columns[column].name, export_columns[column].width,
+                (unsigned long long)state->rows[table]);
+    }
+    if (fclose(schema) != 0) export_failed(final);
+}
+
+// Function to check if the bit at a given block address is set in the bitmap
+bool is_bit_set(char *bitmapblocks, uint blockaddr) {
+    char bitarr[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
+    return (bitmapblocks[blockaddr / 8] & bitarr[blockaddr % 8]) != 0;
+}
+
+// Vector kernels. Each hot loop has a scalar version plus SSE2, AVX2 and
+// AVX-512 versions compiled with target attributes, so a binary built
+// without -march still runs the widest set the CPU supports. kernels_init
+// picks the set at startup; --kernels forces one.
+
+// True if length bytes at data are all zero.
+bool is_zero_generic(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint64_t acc = 0;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        acc |= word;
+    }
+    for (; length > 0; length--, bytes++) acc |= *bytes;
+    return acc == 0;
+}
+
+// Returns the index of the first address that is non-zero and outside
+// [lo, hi), or count if there is none.
+uint first_outside_generic(const uint *addresses, uint count, uint lo, uint hi) {
+    for (uint idx = 0; idx < count; idx++) {
+        if (addresses[idx] != 0 && addresses[idx] - lo >= hi - lo) return idx;
+    }
+    return count;
+}
+
+// Returns the first index i of in_use[0, count) where in_use[i] is 0 but
+// the bitmap marks block first_block + i allocated, or count.
+uint first_unused_allocated_generic(const int *in_use, const char *bitmap, uint first_block, uint count) {
+    for (uint idx = 0; idx < count; idx++) {
+        if (in_use[idx] == 0 && is_bit_set((char *)bitmap, first_block + idx)) return idx;
+    }
+    return count;
+}
+
+#define CRC32C_POLY 0x82F63B78
+
+uint crc32c_table[256];
+
+uint crc32c_software(uint crc, const unsigned char *data, size_t length) {
+    crc = ~crc;
+    while (length--) {
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Bitmap bits for blocks [block, block + width), width at most 24.
+static inline uint bitmap_bits(const char *bitmap, uint block, uint width) {
+    uint word;
+    memcpy(&word, bitmap + block / 8, sizeof(word));
+    return (word >> (block % 8)) & ((1u << width) - 1);
+}
+
+// Returns the first block of [0, count) the scalar kernel reports, after
+// index, for the tails the vector loops leave.
+static inline uint first_unused_allocated_tail(const int *in_use, const char *bitmap, uint first_block, uint index, uint count) {
+    return index + first_unused_allocated_generic(in_use + index, bitmap, first_block + index, count - index);
+}
+
+__attribute__((target("sse2")))
+bool is_zero_sse2(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (; length >= 64; length -= 64, bytes += 64) {
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)bytes),
+                                                _mm_loadu_si128((const __m128i *)(bytes + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i *)(bytes + 32)),
+                                                _mm_loadu_si128((const __m128i *)(bytes + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff) return false;
+    }
+    return is_zero_generic(bytes, length);
+}
+
+__attribute__((target("sse2")))
+uint first_outside_sse2(const uint *addresses, uint count, uint lo, uint hi) {
+    // Unsigned a - lo < hi - lo, as a signed compare with the sign bit flipped
+    __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i low = _mm_set1_epi32(lo);
+    __m128i span = _mm_xor_si128(_mm_set1_epi32(hi - lo), bias);
+    uint idx = 0;
+    for (; idx + 4 <= count; idx += 4) {
+        __m128i address = _mm_loadu_si128((const __m128i *)(addresses + idx));
+        __m128i inside = _mm_cmplt_epi32(_mm_xor_si128(_mm_sub_epi32(address, low), bias), span);
+        __m128i empty = _mm_cmpeq_epi32(address, _mm_setzero_si128());
+        int bad = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(_mm_or_si128(inside, empty), _mm_set1_epi32(-1))));
+        if (bad != 0) return idx + __builtin_ctz(bad);
+    }
+    return idx + first_outside_generic(addresses + idx, count - idx, lo, hi);
+}
+
+__attribute__((target("sse2")))
+uint first_unused_allocated_sse2(const int *in_use, const char *bitmap, uint first_block, uint count) {
+    uint idx = 0;
+    for (; idx + 4 <= count; idx += 4) {
+        __m128i unused = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(in_use + idx)), _mm_setzero_si128());
+        uint hits = _mm_movemask_ps(_mm_castsi128_ps(unused)) & bitmap_bits(bitmap, first_block + idx, 4);
+        if (hits != 0) return idx + __builtin_ctz(hits);
+    }
+    return first_unused_allocated_tail(in_use, bitmap, first_block, idx, count);
+}
+
+__attribute__((target("avx2")))
+bool is_zero_avx2(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (; length >= 64; length -= 64, bytes += 64) {
+        __m256i acc = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)bytes),
+                                      _mm256_loadu_si256((const __m256i *)(bytes + 32)));
+        if (!_mm256_testz_si256(acc, acc)) return false;
+    }
+    return is_zero_generic(bytes, length);
+}
+
+__attribute__((target("avx2")))
+uint first_outside_avx2(const uint *addresses, uint count, uint lo, uint hi) {
+    __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    __m256i low = _mm256_set1_epi32(lo);
+    __m256i span = _mm256_xor_si256(_mm256_set1_epi32(hi - lo), bias);
+    uint idx = 0;
+    for (; idx + 8 <= count; idx += 8) {
+        __m256i address = _mm256_loadu_si256((const __m256i *)(addresses + idx));
+        __m256i inside = _mm256_cmpgt_epi32(span, _mm256_xor_si256(_mm256_sub_epi32(address, low), bias));
+        __m256i empty = _mm256_cmpeq_epi32(address, _mm256_setzero_si256());
+        int bad = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(inside, empty))) & 0xff;
+        if (bad != 0) return idx + __builtin_ctz(bad);
+    }
+    return idx + first_outside_generic(addresses + idx, count - idx, lo, hi);
+}
+
+__attribute__((target("avx2")))
+uint first_unused_allocated_avx2(const int *in_use, const char *bitmap, uint first_block, uint count) {
+    uint idx = 0;
+    for (; idx + 8 <= count; idx += 8) {
+        __m256i unused = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(in_use + idx)), _mm256_setzero_si256());
+        uint hits = _mm256_movemask_ps(_mm256_castsi256_ps(unused)) & bitmap_bits(bitmap, first_block + idx, 8);
+        if (hits != 0) return idx + __builtin_ctz(hits);
+    }
+    return first_unused_allocated_tail(in_use, bitmap, first_block, idx, count);
+}
+
+__attribute__((target("avx512f")))
+bool is_zero_avx512(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (; length >= 64; length -= 64, bytes += 64) {
+        __m512i block = _mm512_loadu_si512(bytes);
+        if (_mm512_test_epi64_mask(block, block) != 0) return false;
+    }
+    return is_zero_generic(bytes, length);
+}
+
+__attribute__((target("avx512f")))
+uint first_outside_avx512(const uint *addresses, uint count, uint lo, uint hi) {
+    __m512i low = _mm512_set1_epi32(lo);
+    __m512i span = _mm512_set1_epi32(hi - lo);
+    uint idx = 0;
+    for (; idx + 16 <= count; idx += 16) {
+        __m512i address = _mm512_loadu_si512(addresses + idx);
+        uint bad = _mm512_test_epi32_mask(address, address) & _mm512_cmpge_epu32_mask(_mm512_sub_epi32(address, low), span);
+        if (bad != 0) return idx + __builtin_ctz(bad);
+    }
+    return idx + first_outside_generic(addresses + idx, count - idx, lo, hi);
+}
+
+__attribute__((target("avx512f")))
+uint first_unused_allocated_avx512(const int *in_use, const char *bitmap, uint first_block, uint count) {
+    uint idx = 0;
+    for (; idx + 16 <= count; idx += 16) {
+        uint unused = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(in_use + idx), _mm512_setzero_si512());
+        uint hits = unused & bitmap_bits(bitmap, first_block + idx, 16);
+        if (hits != 0) return idx + __builtin_ctz(hits);
+    }
+    return first_unused_allocated_tail(in_use, bitmap, first_block, idx, count);
+}
+
+// SSE4.2 crc32 instruction, eight bytes per step.
+__attribute__((target("sse4.2")))
+uint crc32c_sse42(uint crc, const unsigned char *data, size_t length) {
+    uint64_t value = ~crc & 0xffffffffu;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    uint crc32 = (uint)value;
+    for (; length > 0; length--, data++) {
+        crc32 = _mm_crc32_u8(crc32, *data);
+    }
+    return ~crc32;
+}
+#endif
+
+typedef struct _kernel_set {
+    const char *name;
+    const char *cpu_feature;  // required CPU feature, NULL for none
+    bool (*is_zero)(const void *data, size_t length);
+    uint (*first_outside)(const uint *addresses, uint count, uint lo, uint hi);
+    uint (*first_unused_allocated)(const int *in_use, const char *bitmap, uint first_block, uint count);
+} kernel_set;
+
+// In order of preference, widest last.
+kernel_set kernel_sets[] = {
+    { "generic", NULL, is_zero_generic, first_outside_generic, first_unused_allocated_generic },
+#if defined(__x86_64__)
+    { "sse2", "sse2", is_zero_sse2, first_outside_sse2, first_unused_allocated_sse2 },
+    { "avx2", "avx2", is_zero_avx2, first_outside_avx2, first_unused_allocated_avx2 },
+    { "avx512", "avx512f", is_zero_avx512, first_outside_avx512, first_unused_allocated_avx512 },
+#endif
+};
+
+#define KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+kernel_set *active_kernels = &kernel_sets[0];
+
+bool kernel_set_supported(kernel_set *set) {
+    if (set->cpu_feature == NULL) return true;
+#if defined(__x86_64__)
+    // __builtin_cpu_supports needs a string literal
+    if (strcmp(set->cpu_feature, "sse2") == 0) return __builtin_cpu_supports("sse2");
+    if (strcmp(set->cpu_feature, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(set->cpu_feature, "avx512f") == 0) return __builtin_cpu_supports("avx512f");
+#endif
+    return false;
+}
+
+// Selects the named kernel set, or the widest one the CPU supports.
+void kernels_init(const char *name) {
+    __builtin_cpu_init();
+    for (uint idx = 0; idx < KERNEL_SETS; idx++) {
+        kernel_set *set = &kernel_sets[idx];
+        if (name != NULL && strcmp(name, set->name) != 0) continue;
+        if (!kernel_set_supported(set)) {
+            if (name != NULL) exit_with_error("kernel set not supported by this CPU.");
+            continue;
+        }
+        active_kernels = set;
+        if (name != NULL) return;
+    }
+    if (name != NULL && strcmp(name, active_kernels->name) != 0) {
+        exit_with_error("unknown kernel set.");
+    }
+}
+
+// Check Point 1
+// Function to validate the type of an inode
+void validate_inode_type(struct dinode *inode) {
+   bool is_invalid_inode_type = inode->type != INODE_FILE && inode->type != INODE_DIR && inode->type != INODE_DEV;
+
+  // Check matched to allowed values
+  if(is_invalid_inode_type) {
+    exit_with_error("bad inode.");
+  }
+
+}
+
+// Point 2
+// Rejects a block address that does not fall in the data region. The
+// address goes to the error site, whose line names the metadata region a
+// pointer into it hits.
+void validate_data_address(fs_geometry *geo, uint address, const char *error_message) {
+    if (classify_block(geo, address) == REGION_DATA) return;
+    current_site.block = address;
+    exit_with_error(error_message);
+}
+
+// Point 2
+// Validates the addresses listed in an indirect block.
+void validate_indirect_entries(img_pointers *image, uint indirect_block_address) {
+    uint *indirect_block_ptr = (uint *)block_addr(image, indirect_block_address);
+    verdict_key key;
+
+    if (active_cache != NULL) {
+        key = verdict_block_key(active_cache, VERDICT_INDIRECT_BLOCK, (char *)indirect_block_ptr);
+        if (verdict_cache_contains(active_cache, key)) return;
+    }
+
+    uint bad = active_kernels->first_outside(indirect_block_ptr, NINDIRECT, image->geo.data_start, image->geo.region_end[REGION_DATA]);
+    if (bad < NINDIRECT) {
+        validate_data_address(&image->geo, indirect_block_ptr[bad], "bad indirect address in inode.");
+    }
+
+    if (active_cache != NULL) verdict_cache_remember(active_cache, key);
+}
+
+// Point 2
+// Function to validate both direct and indirect block addresses in an inode
+void validate_block_addresses(struct superblock *sb, struct dinode *inode, img_pointers *image) {
+    // Validate direct block addresses
+    uint bad = active_kernels->first_outside(inode->addrs, NDIRECT, image->geo.data_start, image->geo.region_end[REGION_DATA]);
+    if (bad < NDIRECT) {
+        validate_data_address(&image->geo, inode->addrs[bad], "bad direct address in inode.");
+    }
+
+    // Validate indirect block addresses
+    uint indirect_block_address = inode->addrs[NDIRECT];
+    if (indirect_block_address == 0) return; // No indirect block
+
+    validate_data_address(&image->geo, indirect_block_address, "bad indirect address in inode.");
+    validate_indirect_entries(image, indirect_block_address);
+}
+
+// Point 3: Verifies the existence of the root directory and that it references itself as its parent.
+void check_root_directory(struct dinode *root_inode, img_pointers *image) {
+    uint block_address = root_inode->addrs[0];
+    if (block_address == 0) {
+        exit_with_error("root directory does not exist.");
+    }
+
+    struct dirent *directory_entry = (struct dirent *)block_addr(image, block_address);
+    if (strcmp(directory_entry->name, ".") != 0 || directory_entry->inum != 1) {
+        exit_with_error("root directory does not exist.");
+    }
+    directory_entry++;
+    if (strcmp(directory_entry->name, "..") != 0 || directory_entry->inum != 1) {
+        exit_with_error("root directory does not exist.");
+    }
+}
+
+// Point 4: Ensures every directory has entries for '.' and '..', pointing to itself and its parent respectively.
+void check_directory_entries(struct dinode *inode, img_pointers *image, int inode_number) {
+    bool found_dot = false, found_dotdot = false;
+    uint block_address;
+
+    for (int dir_idx = 0; dir_idx < NDIRECT; dir_idx++) {
+        block_address = inode->addrs[dir_idx];
+        if (block_address == 0) continue;
+
+        struct dirent *directory_entry = (struct dirent *)block_addr(image, block_address);
+        int entries_per_block = BSIZE / sizeof(struct dirent);
+        for (int entry_idx = 0; entry_idx < entries_per_block; entry_idx++, directory_entry++) {
+            if (strcmp(directory_entry->name, ".") == 0) {
+                found_dot = true;
+                if (directory_entry->inum != inode_number) {
+                    exit_with_error("directory not properly formatted");
+                }
+            } else if (strcmp(directory_entry->name, "..") == 0) {
+                found_dotdot = true;
+            }
+            if (found_dot && found_dotdot) break;
+        }
+        if (found_dot && found_dotdot) break;
+    }
+
+    if (!found_dot || !found_dotdot) {
+        exit_with_error("directory not properly formatted.");
+    }
+}
+
+
+// Function to verify directory structure integrity
+// Point 3: Verifies the existence of the root directory and that it references itself as its parent.
+// Point 4: Ensures every directory has entries for '.' and '..', pointing to itself and its parent respectively.
+void validate_directory_structure(struct dinode *inode, img_pointers *image, int inode_number) {
+
+    bool found_dot = false, found_dotdot = false;
+    uint block_address;
+    verdict_key key;
+
+    // The verdict depends on the inode number and the directory's direct blocks
+    if (active_cache != NULL) {
+        key = verdict_key_start(active_cache, VERDICT_DIRECTORY ^ ((uint64_t)inode_number << 8));
+        verdict_key_add(&key, inode, sizeof(*inode));
+        for (int dir_idx = 0; dir_idx < NDIRECT; dir_idx++) {
+            if (inode->addrs[dir_idx] != 0) {
+                verdict_key_add(&key, block_addr(image, inode->addrs[dir_idx]), BLOCK_SIZE);
+            }
+        }
+        key = verdict_key_finish(key);
+        if (verdict_cache_contains(active_cache, key)) return;
+    }
+    
+    for (int dir_idx = 0; dir_idx < NDIRECT; dir_idx++) {
+        block_address = inode->addrs[dir_idx];
+        if (block_address == 0) continue;
+
+        struct dirent *directory_entry = (struct dirent *)block_addr(image, block_address);
+        int entries_per_block = BSIZE / sizeof(struct dirent);
+        for (int entry_idx = 0; entry_idx < entries_per_block; entry_idx++, directory_entry++) {
+            if (strcmp(directory_entry->name, ".") == 0) {
+                found_dot = true;
+                if (directory_entry->inum != inode_number) {
+                    current_site.block = block_address;
+                    exit_with_error("directory not properly formatted");
+                }
+            } else if (strcmp(directory_entry->name, "..") == 0) {
+                found_dotdot = true;
+                bool root_dir_issue = (inode_number == 1 && directory_entry->inum != inode_number) ||
+                                      (inode_number != 1 && directory_entry->inum == inode_number);
+                if (root_dir_issue) {
+                    current_site.block = block_address;
+                    exit_with_error("root directory does not exist.");
+                }
+            }
+            if (found_dot && found_dotdot) break;
+        }
+        if (found_dot && found_dotdot) break;
+    }
+
+    if (!found_dot || !found_dotdot) {
+        exit_with_error("directory not properly formatted.");
+    }
+
+    if (active_cache != NULL) verdict_cache_remember(active_cache, key);
+}
+
+// Point 5
+// Function to ensure that all addresses used by an inode are marked as used in the bitmap
+void validate_bitmap_addr(char *bitmapblocks, struct dinode *inode, img_pointers *image) {
+    for (int idx = 0; idx <= NDIRECT; idx++) {
+        uint address = inode->addrs[idx];
+        if (address != 0 && !is_bit_set(bitmapblocks, address)) {
+            current_site.block = address;
+            exit_with_error("address used by inode but marked free in bitmap.");
+        }
+
+        // Special handling for indirect address; 0 means the inode has none
+        if (idx == NDIRECT && address != 0) {
+            uint *indirect_block = (uint *)block_addr(image, address);
+            for (int indirect_idx = 0; indirect_idx < NINDIRECT; indirect_idx++) {
+                uint indirect_address = indirect_block[indirect_idx];
+                if (indirect_address != 0 && !is_bit_set(bitmapblocks, indirect_address)) {
+                    current_site.block = indirect_address;
+                    exit_with_error("address used by inode but marked free in bitmap.");
+                }
+            }
+        }
+    }
+}
+
+// This function performs a series of checks on each inode as per the specified points 1 to 5.
+// It iterates through each inode to ensure they adhere to the defined filesystem integrity points.
+// With a verdict cache, an inode block whose bytes already passed Points 1
+// and 2 skips them; its indirect blocks and directories are looked up in turn.
+void validate_inodes(char *inodeblocks, char *bitmapblocks, img_pointers *image, struct superblock *sb) {
+    struct dinode *current_inode = (struct dinode *)inodeblocks;
+    bool block_cached = false;
+    verdict_key block_key;
+
+    for (int inode_index = 0; inode_index < sb->ninodes; inode_index++, current_inode++) {
+        if (throttle.active && inode_index % IPB == 0) throttle_read(BLOCK_SIZE);
+        if (active_cache != NULL && inode_index % IPB == 0) {
+            // Reaching the next block means every inode of the last one passed
+            if (inode_index > 0 && !block_cached) verdict_cache_remember(active_cache, block_key);
+            block_key = verdict_block_key(active_cache, VERDICT_INODE_BLOCK, (char *)current_inode);
+            block_cached = verdict_cache_contains(active_cache, block_key);
+        }
+
+        if (current_inode->type == 0) {
+            // Skip processing for unallocated (free) inodes
+            continue;
+        }
+        current_site = (error_site){ inode_index, 0 };
+
+        if (block_cached) {
+            // Points 1 and 2 for the inode itself are known to pass
+            if (current_inode->addrs[NDIRECT] != 0) {
+                validate_indirect_entries(image, current_inode->addrs[NDIRECT]);
+            }
+        } else {
+            // Point 1: Validate inode type
+            validate_inode_type(current_inode);
+
+            // Point 2: Validate direct and indirect block addresses
+            validate_block_addresses(sb, current_inode, image);
+        }
+
+        // Point 3 and 4: Validate directory structure
+        if (inode_index == 1) { // Root directory specific check
+            if (current_inode->type != INODE_DIR) {
+                exit_with_error("root directory does not exist.");
+            }
+            validate_directory_structure(current_inode, image, 1);
+        } else if (current_inode->type == INODE_DIR) {
+            validate_directory_structure(current_inode, image, inode_index);
+        }
+
+        // Point 5: Validate bitmap address
+        validate_bitmap_addr(bitmapblocks, current_inode, image);
+
+        if (active_export != NULL) export_inode(active_export, image, inode_index, current_inode);
+    }
+
+    if (active_cache != NULL && sb->ninodes > 0 && !block_cached) verdict_cache_remember(active_cache, block_key);
+}
+
+
+// Addresses referenced by in-use inodes, gathered for Points 6 to 8 in one
+// pass over the inode table. Each slice of the inode table files its
+// addresses under the data region shard they fall in, so a shard reads
+// only its own addresses instead of every inode again. Not built when the
+// checks run as a single shard, which scans the inodes directly.
+enum address_kind { ADDRESS_DIRECT, ADDRESS_INDIRECT_BLOCK, ADDRESS_INDIRECT_ENTRY, ADDRESS_KINDS };
+
+typedef struct _address_list {
+    uint *items;      // block indexes from the start of the data region
+    uint count;
+    uint capacity;
+} address_list;
+
+typedef struct _address_buckets {
+    img_pointers *image;
+    char *inodeblocks;
+    uint ninodes;
+    uint start_block;
+    uint nblocks;
+    uint nshards;
+    address_list *lists;   // [inode slice][data shard][kind], nshards slices
+} address_buckets;
+
+// Left over if a check was trapped after gathering
+address_buckets *gathered_addresses = NULL;
+
+// The shard holding item of count items split nshards ways.
+static inline uint shard_of(uint item, uint count, uint nshards) {
+    uint shard = (uint)((uint64_t)item * nshards / count);
+    while (shard + 1 < nshards && item >= shard_begin(count, shard + 1, nshards)) shard++;
+    return shard;
+}
+
+static inline address_list *address_bucket(address_buckets *buckets, uint slice, uint shard, enum address_kind kind) {
+    return &buckets->lists[((size_t)slice * buckets->nshards + shard) * ADDRESS_KINDS + kind];
+}
+
+void address_list_add(address_list *list, uint item) {
+    if (list->count == list->capacity) {
+        uint capacity = list->capacity ? list->capacity * 2 : 64;
+        mem_account(MEM_BLOCK_USAGE, (capacity - list->capacity) * sizeof(uint));
+        list->items = realloc(list->items, capacity * sizeof(uint));
+        if (list->items == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+}
+
+// Files address under its shard, ignoring addresses outside the data
+// region, which Point 2 has already reported.
+static inline void gather_address(address_buckets *buckets, uint slice, uint address, enum address_kind kind) {
+    uint item = address - buckets->start_block;
+    if (address == 0 || item >= buckets->nblocks) return;
+    address_list_add(address_bucket(buckets, slice, shard_of(item, buckets->nblocks, buckets->nshards), kind), item);
+}
+
+// Gathers the addresses of one slice of the inode table per iteration.
+void gather_slices(void *ctx, uint begin, uint end) {
+    address_buckets *buckets = ctx;
+
+    for (uint slice = begin; slice < end; slice++) {
+        uint first = shard_begin(buckets->ninodes, slice, buckets->nshards);
+        uint last = shard_begin(buckets->ninodes, slice + 1, buckets->nshards);
+        struct dinode *inode = (struct dinode *)buckets->inodeblocks + first;
+
+        for (uint inum = first; inum < last; inum++, inode++) {
+            if (inode->type == 0) continue;
+            for (int idx = 0; idx < NDIRECT; idx++) {
+                gather_address(buckets, slice, inode->addrs[idx], ADDRESS_DIRECT);
+            }
+            if (inode->addrs[NDIRECT] == 0) continue;
+            gather_address(buckets, slice, inode->addrs[NDIRECT], ADDRESS_INDIRECT_BLOCK);
+            uint *entries = (uint *)block_addr(buckets->image, inode->addrs[NDIRECT]);
+            for (int idx = 0; idx < NINDIRECT; idx++) {
+                gather_address(buckets, slice, entries[idx], ADDRESS_INDIRECT_ENTRY);
+            }
+        }
+    }
+}
+
+void free_gathered_addresses(void) {
+    if (gathered_addresses == NULL) return;
+    size_t nlists = (size_t)gathered_addresses->nshards * gathered_addresses->nshards * ADDRESS_KINDS;
+    for (size_t idx = 0; idx < nlists; idx++) {
+        free(gathered_addresses->lists[idx].items);
+    }
+    free(gathered_addresses->lists);
+    free(gathered_addresses);
+    gathered_addresses = NULL;
+}
+
+// Builds gathered_addresses for the shards of the data region, or leaves
+// it NULL when there is a single shard.
+void gather_addresses(char *inodeblocks, img_pointers *image, struct superblock *sb, uint start_block) {
+    free_gathered_addresses();
+    uint nshards = shard_count(sb->nblocks);
+    if (nshards == 1) return;
+
+    address_buckets *buckets = xcalloc(MEM_BLOCK_USAGE, 1, sizeof(address_buckets));
+    *buckets = (address_buckets){ image, inodeblocks, sb->ninodes, start_block, sb->nblocks, nshards, NULL };
+    buckets->lists = xcalloc(MEM_BLOCK_USAGE, (size_t)nshards * nshards * ADDRESS_KINDS, sizeof(address_list));
+    gathered_addresses = buckets;
+    parallel_for("address gather", nshards, 1, gather_slices, buckets);
+}
+
+// Applies fn to every gathered address of the given kind in shard [lo, hi).
+static inline void for_each_gathered(address_buckets *buckets, uint lo, enum address_kind kind, void (*fn)(void *, uint), void *ctx) {
+    uint shard = shard_of(lo, buckets->nblocks, buckets->nshards);
+    for (uint slice = 0; slice < buckets->nshards; slice++) {
+        address_list *list = address_bucket(buckets, slice, shard, kind);
+        for (uint idx = 0; idx < list->count; idx++) fn(ctx, list->items[idx]);
+    }
+}
+
+// Points 6 to 8 run over the data region in shards, one per worker. Each
+// shard first-touches and fills only its own slice of the usage arrays,
+// counting just the addresses that fall in [lo, hi), so the arrays are
+// written from one NUMA node per slice. Shards record their first
+// violation and the calling thread reports the lowest one, which is the
+// error a serial scan would have hit first.
+typedef struct _usage_pass {
+    img_pointers *image;
+    struct superblock *sb;
+    char *inodeblocks;
+    char *bitmapblocks;
+    uint start_block;
+    int *blocks_in_use;
+    uint *direct_usage_counts;
+    uint *indirect_usage_counts;
+    uint64_t first_error;   // lowest (block index << 1 | rule), UINT64_MAX if none
+} usage_pass;
+
+void record_usage_error(usage_pass *pass, uint64_t error) {
+    uint64_t current = __atomic_load_n(&pass->first_error, __ATOMIC_RELAXED);
+    while (error < current && !__atomic_compare_exchange_n(&pass->first_error, &current, error, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// True if address lies in the shard [lo, hi) of the data region.
+static inline bool in_shard(uint address, uint start_block, uint lo, uint hi) {
+    return address - start_block - lo < hi - lo;
+}
+
+// Point 6
+// This function identifies the data blocks actively used by a given inode.
+// It marks both direct and indirect blocks as used in the used_dbs array.
+void get_active_data_blocks(struct dinode *inode, int *used_blocks_array, img_pointers *image, uint starting_block, uint lo, uint hi){
+    uint addresses[MAXFILE];
+    uint nslots = decode_block_map(image, inode, addresses);
+
+    // The indirect block itself is in use as well as the blocks it lists
+    if (inode->addrs[NDIRECT] != 0 && in_shard(inode->addrs[NDIRECT], starting_block, lo, hi)) {
+        used_blocks_array[inode->addrs[NDIRECT] - starting_block] = 1;
+    }
+
+    // Marking every data block as used, skipping empty addresses
+    for (uint slot = 0; slot < nslots; slot++) {
+        if (addresses[slot] != 0 && in_shard(addresses[slot], starting_block, lo, hi)) {
+            used_blocks_array[addresses[slot] - starting_block] = 1;
+        }
+    }
+}
+
+static void mark_block_in_use(void *ctx, uint item) {
+    ((usage_pass *)ctx)->blocks_in_use[item] = 1;
+}
+
+// Point 6
+// Checks one shard of the data region against the bitmap.
+void verify_bitmap_shard(void *ctx, uint lo, uint hi) {
+    usage_pass *pass = ctx;
+    memset(pass->blocks_in_use + lo, 0, (hi - lo) * sizeof(int));
+
+    if (gathered_addresses != NULL) {
+        for (int kind = 0; kind < ADDRESS_KINDS; kind++) {
+            for_each_gathered(gathered_addresses, lo, kind, mark_block_in_use, pass);
+        }
+    } else {
+        // Iterating through inodes to flag used blocks
+        struct dinode *current_inode = (struct dinode *)pass->inodeblocks;
+        for (int inode_idx = 0; inode_idx < pass->sb->ninodes; inode_idx++, current_inode++) {
+            if (current_inode->type == 0) continue; // Skip unused inodes
+
+            get_active_data_blocks(current_inode, pass->blocks_in_use, pass->image, pass->start_block, lo, hi);
+        }
+    }
+
+    // Verifying bitmap against the block usage array, one bitmap block at a time
+    for (uint chunk = lo; chunk < hi; chunk += BPB) {
+        uint count = hi - chunk < BPB ? hi - chunk : BPB;
+        if (throttle.active) throttle_read(BLOCK_SIZE);
+        uint found = active_kernels->first_unused_allocated(pass->blocks_in_use + chunk, pass->bitmapblocks, pass->start_block + chunk, count);
+        if (found < count) {
+            record_usage_error(pass, (uint64_t)(chunk + found) << 1);
+            return;
+        }
+    }
+}
+
+// Point 6
+// Validates that all blocks marked as used in the bitmap are indeed used by some inode.
+void verify_bitmap_usage(char *inodeblocks, char *bitmapblocks, img_pointers *image, struct superblock *sb, uint start_block) {
+    usage_pass pass = { image, sb, inodeblocks, bitmapblocks, start_block, NULL, NULL, NULL, UINT64_MAX };
+    pass.blocks_in_use = xmalloc_untouched(MEM_BLOCK_USAGE, sb->nblocks, sizeof(int));
+
+    parallel_shards("bitmap shard", sb->nblocks, verify_bitmap_shard, &pass);
+    free(pass.blocks_in_use);
+
+    if (pass.first_error != UINT64_MAX) {
+        current_site = (error_site){ 0, start_block + (uint)(pass.first_error >> 1) };
+        exit_with_error("bitmap marks block in use but it is not in use.");
+    }
+}
+
+// Point 7
+// This function tallies the occurrences of direct block addresses used by an inode.
+void tally_direct_block_usage(struct dinode *target_inode, uint *direct_usage_array, uint start_block, uint lo, uint hi) {
+    uint address;
+
+    // Looping through the direct addresses in the inode
+    for (int idx = 0; idx < NDIRECT; idx++) {
+        address = target_inode->addrs[idx];
+        if (address == 0 || !in_shard(address, start_block, lo, hi)) continue; // Skip if not in use here
+
+        // Incrementing the usage count for each direct block address
+        direct_usage_array[address - start_block]++;
+    }
+}
+
+// Point 8 
+// This function accounts for the usage of indirect block addresses within an inode.
+void count_indirect_block_usage(struct dinode *target_inode, uint *indirect_usage_array, img_pointers *image, uint start_block, uint lo, uint hi) {
+    uint indirect_block_address = target_inode->addrs[NDIRECT];
+
+    if (indirect_block_address == 0) return; // No indirect block present
+
+    // Accessing the array of indirect block addresses
+    uint *indirect_block_ptr = (uint *)block_addr(image, indirect_block_address);
+
+    // Iterating over the indirect block addresses
+    for (int idx = 0; idx < NINDIRECT; idx++) {
+        uint current_address = indirect_block_ptr[idx];
+        if (current_address != 0 && in_shard(current_address, start_block, lo, hi)) {
+            // Incrementing the usage count for each indirect block address
+            indirect_usage_array[current_address - start_block]++;
+        }
+    }
+}
+
+static void count_direct_use(void *ctx, uint item) {
+    ((usage_pass *)ctx)->direct_usage_counts[item]++;
+}
+
+static void count_indirect_use(void *ctx, uint item) {
+    ((usage_pass *)ctx)->indirect_usage_counts[item]++;
+}
+
+// Point 7 and 8
+// Checks one shard of the data region for addresses used more than once.
+void uniqueness_shard(void *ctx, uint lo, uint hi) {
+    usage_pass *pass = ctx;
+    memset(pass->direct_usage_counts + lo, 0, (hi - lo) * sizeof(uint));
+    memset(pass->indirect_usage_counts + lo, 0, (hi - lo) * sizeof(uint));
+
+    if (gathered_addresses != NULL) {
+        for_each_gathered(gathered_addresses, lo, ADDRESS_DIRECT, count_direct_use, pass);
+        for_each_gathered(gathered_addresses, lo, ADDRESS_INDIRECT_ENTRY, count_indirect_use, pass);
+    } else {
+        // Iterating through each inode to accumulate address usage
+        struct dinode *current_inode = (struct dinode *)pass->inodeblocks;
+        for (int inode_idx = 0; inode_idx < pass->sb->ninodes; inode_idx++, current_inode++) {
+            if (current_inode->type == 0) continue; // Skip unused inodes
+
+            // Tallying the usage of direct and indirect block addresses
+            tally_direct_block_usage(current_inode, pass->direct_usage_counts, pass->start_block, lo, hi);
+            count_indirect_block_usage(current_inode, pass->indirect_usage_counts, pass->image, pass->start_block, lo, hi);
+        }
+    }
+
+    // Verifying that each address is used only once
+    for (uint block_idx = lo; block_idx < hi; block_idx++) {
+        if (throttle.active && block_idx % BPB == 0) throttle_read(0);
+        if (pass->direct_usage_counts[block_idx] > 1) {
+            record_usage_error(pass, (uint64_t)block_idx << 1);
+            return;
+        }
+        if (pass->indirect_usage_counts[block_idx] > 1) {
+            record_usage_error(pass, ((uint64_t)block_idx << 1) | 1);
+            return;
+        }
+    }
+}
+
+// Point 7 and 8
+// Function to ensure that each block address within in-use inodes is uniquely used.
+void validate_block_address_uniqueness(char *inodeblocks, img_pointers *image, struct superblock *sb, uint start_block) {
+    usage_pass pass = { image, sb, inodeblocks, NULL, start_block, NULL, NULL, NULL, UINT64_MAX };
+
+    // Arrays to track the usage count of direct and indirect addresses.
+    pass.direct_usage_counts = xmalloc_untouched(MEM_BLOCK_USAGE, sb->nblocks, sizeof(uint));
+    pass.indirect_usage_counts = xmalloc_untouched(MEM_BLOCK_USAGE, sb->nblocks, sizeof(uint));
+
+    parallel_shards("uniqueness shard", sb->nblocks, uniqueness_shard, &pass);
+    free(pass.direct_usage_counts);
+    free(pass.indirect_usage_counts);
+
+    if (pass.first_error != UINT64_MAX) {
+        current_site = (error_site){ 0, start_block + (uint)(pass.first_error >> 1) };
+        exit_with_error(pass.first_error & 1 ? "indirect address used more than once." : "direct address used more than once.");
+    }
+}
+
+// Path to inode index, filled in by the directory traversal of Points 9-12
+// when a mode needs to resolve paths. Open addressing keyed by path hash.
+typedef struct _path_entry {
+    char *path;
+    uint inum;
+    bool seen;
+} path_entry;
+
+typedef struct _path_index {
+    path_entry *slots;
+    uint64_t capacity;  // power of two
+    uint64_t count;
+    char **dir_paths;   // per inode: path of each directory reached so far
+} path_index;
+
+path_index *active_path_index = NULL;
+
+void path_index_init(path_index *index, uint ninodes) {
+    index->capacity = 1024;
+    index->count = 0;
+    index->slots = xcalloc(MEM_PATH_INDEX, index->capacity, sizeof(path_entry));
+    index->dir_paths = xcalloc(MEM_PATH_INDEX, ninodes, sizeof(char *));
+    index->dir_paths[ROOTINO] = xstrdup(MEM_PATH_INDEX, "/");
+}
+
+void path_index_free(path_index *index, uint ninodes) {
+    for (uint64_t idx = 0; idx < index->capacity; idx++) free(index->slots[idx].path);
+    for (uint inum = 0; inum < ninodes; inum++) free(index->dir_paths[inum]);
+    free(index->slots);
+    free(index->dir_paths);
+}
+
+path_entry *path_index_slot(path_index *index, const char *path) {
+    uint64_t slot = hash_bytes(path, strlen(path), 0) & (index->capacity - 1);
+    while (index->slots[slot].path != NULL && strcmp(index->slots[slot].path, path) != 0) {
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+    return &index->slots[slot];
+}
+
+// Returns the entry for path, or NULL if the path does not exist.
+path_entry *path_index_find(path_index *index, const char *path) {
+    path_entry *entry = path_index_slot(index, path);
+    return entry->path != NULL ? entry : NULL;
+}
+
+void path_index_insert(path_index *index, char *path, uint inum) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        path_entry *old_slots = index->slots;
+        uint64_t old_capacity = index->capacity;
+        index->capacity *= 2;
+        index->slots = xcalloc(MEM_PATH_INDEX, index->capacity, sizeof(path_entry));
+        for (uint64_t idx = 0; idx < old_capacity; idx++) {
+            if (old_slots[idx].path != NULL) *path_index_slot(index, old_slots[idx].path) = old_slots[idx];
+        }
+        free(old_slots);
+    }
+
+    path_entry *entry = path_index_slot(index, path);
+    if (entry->path != NULL) {
+        free(path);
+        return;
+    }
+    entry->path = path;
+    entry->inum = inum;
+    index->count++;
+}
+
+// Records a directory entry met by the traversal under its full path.
+void path_index_record(path_index *index, uint dir_inum, struct dirent *entry, struct dinode *child) {
+    const char *parent = index->dir_paths[dir_inum];
+    if (parent == NULL) return;
+
+    size_t length = strlen(parent) + DIRSIZ + 2;
+    char *path = xmalloc_untouched(MEM_PATH_INDEX, length, 1);
+    snprintf(path, length, "%s%s%.*s", parent, parent[1] != '\0' ? "/" : "", DIRSIZ, entry->name);
+
+    if (child->type == INODE_DIR && index->dir_paths[entry->inum] == NULL) {
+        index->dir_paths[entry->inum] = xstrdup(MEM_PATH_INDEX, path);
+    }
+    path_index_insert(index, path, entry->inum);
+}
+
+// Arrays of the directory pass, kept reachable here so that check_release
+// can free them when an error unwinds the check through the error trap.
+struct {
+    struct dinode **stack;
+    int *references;
+    int *subdirectories;
+} directory_scratch;
+
+//function for point 9, 10, 11, 12
+//iterate through all directories and count for inodemap (how many times each inode number has been refered by directory).
+//subdirs counts, for each directory, the child directories linked from it.
+void scan_directory_entries(char *inodeblocks, img_pointers *image, struct dinode *rootinode, int *inodemap, int *subdirs) {
+    int initialSize = 100; // Initial stack size, adjust as needed
+    struct dinode **stack = malloc(initialSize * sizeof(struct dinode *));
+    mem_account(MEM_TRAVERSAL_STACK, initialSize * sizeof(struct dinode *));
+    directory_scratch.stack = stack;
+
+    int stackSize = initialSize; 
+    int stackTop = 0;
+
+    // Push the root directory onto the stack
+    stack[stackTop++] = rootinode;
+
+    while (stackTop > 0) {
+        struct dinode *current = stack[--stackTop];
+
+        // Skip if not a directory
+        if (current->type != INODE_DIR) {
+            continue;
+        }
+
+        // Traverse direct addresses
+        for (int i = 0; i < NDIRECT; i++) {
+            uint blockaddr = current->addrs[i];
+            if (blockaddr == 0) continue;
+
+            struct dirent *dir = (struct dirent *)block_addr(image, blockaddr);
+            int entries_per_block = BSIZE / sizeof(struct dirent);
+
+            for (int j = 0; j < entries_per_block; j++, dir++) {
+                if (dir->inum != 0 && strcmp(dir->name, ".") != 0 && strcmp(dir->name, "..") != 0) {
+                    // An entry past the inode table refers to no allocated inode
+                    if (dir->inum >= image->sb->ninodes) {
+                        current_site = (error_site){ current - (struct dinode *)inodeblocks, blockaddr };
+                        exit_with_error("inode referred to in directory but marked free.");
+                    }
+                    inodemap[dir->inum]++;
+                    if (parent_map[dir->inum] == 0) parent_map[dir->inum] = current - (struct dinode *)inodeblocks;
+                    struct dinode *next = ((struct dinode *)(inodeblocks)) + dir->inum;
+                    if (active_path_index != NULL) {
+                        path_index_record(active_path_index, current - (struct dinode *)inodeblocks, dir, next);
+                    }
+                    if (active_export != NULL) {
+                        export_dirent(active_export, current - (struct dinode *)inodeblocks, dir);
+                    }
+                    // A directory is descended into only on its first reference, so a
+                    // directory cycle cannot loop forever; Point 12 reports the repeat.
+                    if (next->type != INODE_DIR || inodemap[dir->inum] > 1) continue;
+                    subdirs[current - (struct dinode *)inodeblocks]++;
+                    if (stackTop == stackSize) {
+                        // Resize the stack if needed
+                        mem_account(MEM_TRAVERSAL_STACK, stackSize * sizeof(struct dinode *));
+                        stackSize *= 2;
+                        stack = realloc(stack, stackSize * sizeof(struct dinode *));
+                        directory_scratch.stack = stack;
+                    }
+                    stack[stackTop++] = next;
+                }
+            }
+        }
+
+        // Traverse indirect address
+        uint blockaddr = current->addrs[NDIRECT];
+
+        if (blockaddr != 0) {
+            uint *indirect = (uint *)block_addr(image, blockaddr);
+            for (int i = 0; i < NINDIRECT; i++, indirect++) {
+                blockaddr = *indirect;
+                if (blockaddr == 0) continue;
+
+                struct dirent *dir = (struct dirent *)block_addr(image, blockaddr);
+                int entries_per_block = BSIZE / sizeof(struct dirent);
+                for (int j = 0; j < entries_per_block; j++, dir++) {
+                    if (dir->inum != 0 && strcmp(dir->name, ".") != 0 && strcmp(dir->name, "..") != 0) {
+                        if (dir->inum >= image->sb->ninodes) {
+                            current_site = (error_site){ current - (struct dinode *)inodeblocks, blockaddr };
+                            exit_with_error("inode referred to in directory but marked free.");
+                        }
+                        inodemap[dir->inum]++;
+                        if (parent_map[dir->inum] == 0) parent_map[dir->inum] = current - (struct dinode *)inodeblocks;
+                        struct dinode *next = ((struct dinode *)(inodeblocks)) + dir->inum;
+                        if (active_path_index != NULL) {
+                            path_index_record(active_path_index, current - (struct dinode *)inodeblocks, dir, next);
+                        }
+                        if (active_export != NULL) {
+                            export_dirent(active_export, current - (struct dinode *)inodeblocks, dir);
+                        }
+                        // Descend into each directory once, as above
+                        if (next->type != INODE_DIR || inodemap[dir->inum] > 1) continue;
+                        subdirs[current - (struct dinode *)inodeblocks]++;
+                        if (stackTop == stackSize) {
+                            // Resize the stack if needed
+                            mem_account(MEM_TRAVERSAL_STACK, stackSize * sizeof(struct dinode *));
+                            stackSize *= 2;
+                            stack = realloc(stack, stackSize * sizeof(struct dinode *));
+                            directory_scratch.stack = stack;
+                        }
+                        stack[stackTop++] = next;
+                    }
+                }
+            }
+        }
+    }
+
+    free(stack);
+    directory_scratch.stack = NULL;
+}
+
+// Point 9, 10, 11, 12
+// Validates directory-related points across all in-use inodes.
+void validate_directory_rules(char *inode_blocks, img_pointers *img, struct superblock *fs_sb) {
+    int *inode_references = directory_scratch.references = xcalloc(MEM_INODE_REFS, fs_sb->ninodes, sizeof(int));
+    int *subdirectories = directory_scratch.subdirectories = xcalloc(MEM_INODE_REFS, fs_sb->ninodes, sizeof(int));
+    struct dinode *curr_inode;
+    free(parent_map); // left over if an earlier check was trapped
+    parent_map = xcalloc(MEM_INODE_REFS, fs_sb->ninodes, sizeof(uint));
+    parent_map[ROOTINO] = ROOTINO;
+    struct dinode *root_inode;
+    curr_inode = (struct dinode *)inode_blocks;
+    root_inode=++curr_inode;
+    
+    // Increment reference count for reserved inodes
+    inode_references[0]++;
+    inode_references[1]++;
+
+    // Analyzing directory entries to count inode references
+    scan_directory_entries(inode_blocks, img, root_inode, inode_references, subdirectories); // Skips the first inode (root)
+    
+    // Verifying directory points for each inode
+    curr_inode++;
+    for (int inode_idx = 2; inode_idx < fs_sb->ninodes; inode_idx++, curr_inode++) {
+        current_site = (error_site){ inode_idx, 0 };
+        if (curr_inode->type != 0 && inode_references[inode_idx] == 0) {
+            exit_with_error("inode marked use but not found in a directory.");
+        }
+        if (inode_references[inode_idx] > 0 && curr_inode->type == 0 ) {
+            exit_with_error("inode referred to in directory but marked free.");
+        }
+        if (curr_inode->type == INODE_FILE && curr_inode->nlink != inode_references[inode_idx]) {
+            exit_with_error("bad reference count for file.");
+        }
+        if (curr_inode->type == INODE_DIR && inode_references[inode_idx] > 1) {
+            exit_with_error("directory appears more than once in file system.");
+        }
+        // A directory is linked once from its parent and once from each
+        // subdirectory's ".."
+        if (curr_inode->type == INODE_DIR && curr_inode->nlink != 1 + subdirectories[inode_idx]) {
+            exit_with_error("bad reference count for directory.");
+        }
+    }
+
+    // The root has no parent entry; its self-referencing ".." is not counted,
+    // as xv6's mkfs creates it with nlink 1
+    current_site = (error_site){ ROOTINO, 0 };
+    // Counted once above for the root itself; any entry naming it again
+    // links the root back into its own tree
+    if (inode_references[ROOTINO] > 1) {
+        exit_with_error("directory appears more than once in file system.");
+    }
+    if (root_inode->nlink != 1 + subdirectories[ROOTINO]) {
+        exit_with_error("bad reference count for directory.");
+    }
+
+    free(inode_references);
+    free(subdirectories);
+    directory_scratch.references = NULL;
+    directory_scratch.subdirectories = NULL;
+}
+
+
+// Hashes the contents of a file, reading exactly inode->size bytes.
+uint64_t hash_file_contents(img_pointers *image, struct dinode *inode) {
+    uint addresses[MAXFILE];
+    decode_block_map(image, inode, addresses);
+
+    uint64_t hash = 0;
+    uint remaining = inode->size;
+    for (uint slot = 0; slot < MAXFILE && remaining > 0; slot++) {
+        uint length = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+        if (addresses[slot] == 0) {
+            static const char hole[BLOCK_SIZE];
+            hash = hash_bytes(hole, length, hash);
+        } else {
+            hash = hash_bytes(block_addr(image, addresses[slot]), length, hash);
+        }
+        remaining -= length;
+    }
+    return hash;
+}
+
+// Hash of a file or device as printed by --digest: type, size, device
+// numbers and contents.
+uint64_t hash_leaf(img_pointers *image, struct dinode *inode) {
+    uint64_t header[4] = { inode->type, inode->size, inode->major, inode->minor };
+    uint64_t content = inode->type == INODE_FILE ? hash_file_contents(image, inode) : 0;
+    return hash_bytes(header, sizeof(header), content);
+}
+
+typedef struct _digest_state {
+    img_pointers *image;
+    struct dinode *inodes;
+    uint64_t *hashes;   // per inode: leaf hash for files, subtree hash for directories
+    bool *done;
+    bool *entered;      // directories digested or being digested, so a cycle ends
+    bool *listed;       // directories already printed
+} digest_state;
+
+// Computes the leaf hashes of every regular file and device in [begin, end).
+void digest_leaves(void *ctx, uint begin, uint end) {
+    digest_state *state = ctx;
+    for (uint inum = begin; inum < end; inum++) {
+        struct dinode *inode = &state->inodes[inum];
+        if (inode->type != INODE_FILE && inode->type != INODE_DEV) continue;
+
+        state->hashes[inum] = hash_leaf(state->image, inode);
+        state->done[inum] = true;
+    }
+}
+
+int compare_dirent_names(const void *a, const void *b) {
+    return strncmp(((const struct dirent *)a)->name, ((const struct dirent *)b)->name, DIRSIZ);
+}
+
+// Collects the entries of a directory other than '.' and '..'.
+// Returns a malloc'd array sorted by name; its length is stored in count.
+struct dirent *list_directory(img_pointers *image, struct dinode *dir, uint *count) {
+    uint addresses[MAXFILE];
+    uint nslots = decode_block_map(image, dir, addresses);
+    int entries_per_block = BSIZE / sizeof(struct dirent);
+    uint capacity = 16, used = 0;
+    struct dirent *entries = malloc(capacity * sizeof(struct dirent));
+    mem_account(MEM_DIRECTORY_LISTS, capacity * sizeof(struct dirent));
+
+    for (uint slot = 0; slot < nslots; slot++) {
+        if (addresses[slot] == 0) continue;
+        struct dirent *entry = (struct dirent *)block_addr(image, addresses[slot]);
+        for (int idx = 0; idx < entries_per_block; idx++, entry++) {
+            if (entry->inum == 0 || strncmp(entry->name, ".", DIRSIZ) == 0 || strncmp(entry->name, "..", DIRSIZ) == 0) {
+                continue;
+            }
+            if (used == capacity) {
+                mem_account(MEM_DIRECTORY_LISTS, capacity * sizeof(struct dirent));
+                capacity *= 2;
+                entries = realloc(entries, capacity * sizeof(struct dirent));
+            }
+            entries[used++] = *entry;
+        }
+    }
+
+    qsort(entries, used, sizeof(struct dirent), compare_dirent_names);
+    *count = used;
+    return entries;
+}
+
+// A directory being walked by --digest: its sorted entries and the next
+// one to visit.
+typedef struct _digest_frame {
+    uint inum;
+    struct dirent *entries;
+    uint count;
+    uint next;
+    uint64_t hash;      // the directory's hash, folded so far
+    size_t path_length; // length of its path, when printing
+} digest_frame;
+
+// Pushes a frame for directory inum, growing the walk's stack as needed.
+digest_frame *digest_push(digest_state *state, digest_frame **stack, uint *depth, uint *capacity, uint inum) {
+    if (*depth == *capacity) {
+        mem_account(MEM_DIGEST, *capacity * sizeof(digest_frame));
+        *capacity *= 2;
+        *stack = realloc(*stack, *capacity * sizeof(digest_frame));
+    }
+    digest_frame *frame = &(*stack)[(*depth)++];
+    frame->inum = inum;
+    frame->entries = list_directory(state->image, &state->inodes[inum], &frame->count);
+    frame->next = 0;
+    frame->hash = hash_bytes("dir", 3, INODE_DIR);
+    frame->path_length = 0;
+    return frame;
+}
+
+digest_frame *digest_stack(uint *capacity) {
+    *capacity = 64;
+    digest_frame *stack = malloc(*capacity * sizeof(digest_frame));
+    mem_account(MEM_DIGEST, *capacity * sizeof(digest_frame));
+    return stack;
+}
+
+// Computes the Merkle hash of every directory below inum, children first,
+// each from its sorted (name, child hash) pairs. The walk keeps its own
+// stack, so any nesting a checked image can hold is digested. A checked
+// image has no directory cycles, but the walk does not rely on it: an entry
+// leading back to a directory still being digested hashes as a marker.
+void digest_directory(digest_state *state, uint inum) {
+    if (state->done[inum]) return;
+    uint depth = 0, capacity;
+    digest_frame *stack = digest_stack(&capacity);
+    state->entered[inum] = true;
+    digest_push(state, &stack, &depth, &capacity, inum);
+
+    while (depth > 0) {
+        digest_frame *frame = &stack[depth - 1];
+        if (frame->next == frame->count) {
+            free(frame->entries);
+            state->hashes[frame->inum] = frame->hash;
+            state->done[frame->inum] = true;
+            depth--;
+            continue;
+        }
+
+        struct dirent *entry = &frame->entries[frame->next];
+        uint child = entry->inum;
+        if (state->inodes[child].type == INODE_DIR && !state->entered[child]) {
+            // Folded in once the child is done, when the walk comes back here
+            state->entered[child] = true;
+            digest_push(state, &stack, &depth, &capacity, child);
+            continue;
+        }
+        uint64_t hash = state->inodes[child].type == INODE_DIR && !state->done[child]
+            ? hash_bytes("cycle", 5, child)
+            : state->hashes[child];
+        frame->hash = hash_bytes(entry->name, strnlen(entry->name, DIRSIZ), frame->hash);
+        frame->hash = hash_bytes(&hash, sizeof(hash), frame->hash);
+        frame->next++;
+    }
+    free(stack);
+}
+
+// Prints "<hash>  <path>" for a directory and everything below it, in name
+// order, descending into each directory once.
+void print_digest_tree(digest_state *state, uint inum) {
+    printf("%016llx  /\n", (unsigned long long)state->hashes[inum]);
+    if (state->inodes[inum].type != INODE_DIR) return;
+
+    size_t path_capacity = 256;
+    char *path = malloc(path_capacity);
+    uint depth = 0, capacity;
+    digest_frame *stack = digest_stack(&capacity);
+    state->listed[inum] = true;
+    digest_push(state, &stack, &depth, &capacity, inum)->path_length = 0;
+
+    while (depth > 0) {
+        digest_frame *frame = &stack[depth - 1];
+        if (frame->next == frame->count) {
+            free(frame->entries);
+            depth--;
+            continue;
+        }
+
+        struct dirent *entry = &frame->entries[frame->next++];
+        size_t length = frame->path_length + 1 + strnlen(entry->name, DIRSIZ);
+        if (length + 1 > path_capacity) {
+            path_capacity = 2 * (length + 1);
+            path = realloc(path, path_capacity);
+        }
+        path[frame->path_length] = '/';
+        memcpy(path + frame->path_length + 1, entry->name, length - frame->path_length - 1);
+        path[length] = '\0';
+        printf("%016llx  %s\n", (unsigned long long)state->hashes[entry->inum], path);
+
+        if (state->inodes[entry->inum].type == INODE_DIR && !state->listed[entry->inum]) {
+            state->listed[entry->inum] = true;
+            digest_push(state, &stack, &depth, &capacity, entry->inum)->path_length = length;
+        }
+    }
+    free(stack);
+    free(path);
+}
+
+// Computes and prints the tree digest of a checked image. The first line is
+// the root hash; the following lines give per-subtree hashes for locating
+// differences between two images.
+void print_tree_digest(img_pointers *image) {
+    digest_state state;
+    uint ninodes = image->sb->ninodes;
+    state.image = image;
+    state.inodes = (struct dinode *)block_addr(image, 2);
+    state.hashes = xcalloc(MEM_DIGEST, ninodes, sizeof(uint64_t));
+    state.done = xcalloc(MEM_DIGEST, ninodes, sizeof(bool));
+    state.entered = xcalloc(MEM_DIGEST, ninodes, sizeof(bool));
+    state.listed = xcalloc(MEM_DIGEST, ninodes, sizeof(bool));
+
+    parallel_for("digest leaves", ninodes, 64, digest_leaves, &state);
+    digest_directory(&state, ROOTINO);
+    print_digest_tree(&state, ROOTINO);
+
+    free(state.hashes);
+    free(state.done);
+    free(state.entered);
+    free(state.listed);
+}
+
+// Returns the inode number of name within a directory, or 0 if absent.
+uint lookup_directory(img_pointers *image, struct dinode *dir, const char *name) {
+    uint addresses[MAXFILE];
+    uint nslots = decode_block_map(image, dir, addresses);
+    int entries_per_block = BSIZE / sizeof(struct dirent);
+
+    for (uint slot = 0; slot < nslots; slot++) {
+        if (addresses[slot] == 0) continue;
+        struct dirent *entry = (struct dirent *)block_addr(image, addresses[slot]);
+        for (int idx = 0; idx < entries_per_block; idx++, entry++) {
+            if (entry->inum != 0 && strncmp(entry->name, name, DIRSIZ) == 0) {
+                return entry->inum;
+            }
+        }
+    }
+    return 0;
+}
+
+// Resolves an absolute or root-relative path to an inode number, or 0.
+uint lookup_path(img_pointers *image, const char *path) {
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    uint inum = ROOTINO;
+    char name[DIRSIZ + 1];
+
+    while (*path != '\0') {
+        while (*path == '/') path++;
+        if (*path == '\0') break;
+
+        size_t length = strcspn(path, "/");
+        if (length > DIRSIZ || inodes[inum].type != INODE_DIR) return 0;
+        memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+
+        inum = lookup_directory(image, &inodes[inum], name);
+        if (inum == 0) return 0;
+    }
+    return inum;
+}
+
+void extract_failed(const char *path) {
+    fprintf(stderr, "extract failed: %s: %s\n", path, strerror(errno));
+    exit(1);
+}
+
+// Copies length bytes at block start of the image to offset of out_fd.
+// copy_file_range keeps the data in the kernel; if the file systems do not
+// support it the bytes are written straight from the mapping instead.
+void copy_block_run(img_pointers *image, uint start, uint64_t length, int out_fd, uint64_t offset, const char *dest) {
+    loff_t in_offset = image->base + ((loff_t)start << image->geo.block_shift);
+    loff_t out_offset = offset;
+
+    if (throttle.active) throttle_read(length);
+    while (length > 0) {
+        ssize_t copied = copy_file_range(image->fd, &in_offset, out_fd, &out_offset, length, 0);
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            copied = pwrite(out_fd, image->mmapimage + (in_offset - image->base), length, out_offset);
+            if (copied > 0) {
+                in_offset += copied;
+                out_offset += copied;
+            }
+        }
+        if (copied <= 0) extract_failed(dest);
+        length -= copied;
+    }
+}
+
+// Extracts a regular file by copying each run of contiguous blocks in one
+// call. The file is created as name relative to dirfd.
+void extract_file(img_pointers *image, struct dinode *inode, int dirfd, const char *name) {
+    uint addresses[MAXFILE];
+    decode_block_map(image, inode, addresses);
+
+    // Never through a link or over a file already there
+    int out_fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (out_fd < 0) extract_failed(name);
+
+    uint64_t nblocks = ((uint64_t)inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (nblocks > MAXFILE) nblocks = MAXFILE;
+
+    for (uint slot = 0; slot < nblocks; ) {
+        if (addresses[slot] == 0) {
+            slot++;
+            continue;
+        }
+        uint run = 1;
+        while (slot + run < nblocks && addresses[slot + run] == addresses[slot] + run) run++;
+
+        uint64_t offset = (uint64_t)slot * BLOCK_SIZE;
+        uint64_t length = (uint64_t)run * BLOCK_SIZE;
+        if (offset + length > inode->size) length = inode->size - offset;
+        copy_block_run(image, addresses[slot], length, out_fd, offset, name);
+        slot += run;
+    }
+
+    // Holes at the end of the file are not covered by any run
+    if (ftruncate(out_fd, inode->size) < 0) extract_failed(name);
+    close(out_fd);
+}
+
+// Copies a directory entry's name into name, failing the extraction if it
+// could leave the directory it is created in: an empty name, "." or "..",
+// or one holding a '/'.
+void extract_name(const struct dirent *entry, char name[DIRSIZ + 1]) {
+    snprintf(name, DIRSIZ + 1, "%.*s", DIRSIZ, entry->name);
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL) {
+        fprintf(stderr, "extract failed: unsafe file name \"%s\" in inode %u\n", name, entry->inum);
+        exit(1);
+    }
+}
+
+typedef struct _extract_job {
+    uint inum;
+    char name[DIRSIZ + 1];
+} extract_job;
+
+// A directory being extracted: its entries, the next one to visit, and
+// the host directory it was created as.
+typedef struct _extract_frame {
+    uint inum;
+    struct dirent *entries;
+    uint count;
+    uint next;
+    dev_t dev;
+    ino_t ino;
+} extract_frame;
+
+typedef struct _extract_state {
+    img_pointers *image;
+    struct dinode *inodes;
+    int dirfd;          // the host directory being filled
+    extract_job *jobs;  // regular files of that directory
+    uint njobs;
+    uint capacity;
+    bool *entered;      // directories already extracted, so none is entered twice
+} extract_state;
+
+void extract_files(void *ctx, uint begin, uint end) {
+    extract_state *state = ctx;
+    for (uint idx = begin; idx < end; idx++) {
+        extract_job *job = &state->jobs[idx];
+        extract_file(state->image, &state->inodes[job->inum], state->dirfd, job->name);
+    }
+}
+
+// Pushes a frame for directory inum, created on the host as state->dirfd,
+// and copies its regular files in parallel. Its subdirectories are left to
+// the walk.
+void extract_enter(extract_state *state, extract_frame **stack, uint *depth, uint *capacity, uint inum) {
+    struct stat st;
+    if (fstat(state->dirfd, &st) < 0) extract_failed("directory");
+    if (*depth == *capacity) {
+        mem_account(MEM_EXTRACT, *capacity * sizeof(extract_frame));
+        *capacity *= 2;
+        *stack = realloc(*stack, *capacity * sizeof(extract_frame));
+    }
+    extract_frame *frame = &(*stack)[(*depth)++];
+    *frame = (extract_frame){ inum, NULL, 0, 0, st.st_dev, st.st_ino };
+    frame->entries = list_directory(state->image, &state->inodes[inum], &frame->count);
+
+    state->njobs = 0;
+    for (uint idx = 0; idx < frame->count; idx++) {
+        if (state->inodes[frame->entries[idx].inum].type != INODE_FILE) continue;
+        if (state->njobs == state->capacity) {
+            mem_account(MEM_EXTRACT, (state->capacity ? state->capacity : 64) * sizeof(extract_job));
+            state->capacity = state->capacity ? state->capacity * 2 : 64;
+            state->jobs = realloc(state->jobs, state->capacity * sizeof(extract_job));
+        }
+        extract_job *job = &state->jobs[state->njobs++];
+        job->inum = frame->entries[idx].inum;
+        extract_name(&frame->entries[idx], job->name);
+    }
+    parallel_for("extract files", state->njobs, 1, extract_files, state);
+}
+
+// Opens name under dirfd as a directory, replacing dirfd. Only dest itself
+// may be reached through a symbolic link.
+void extract_change_directory(extract_state *state, const char *name) {
+    int fd = openat(state->dirfd, name, O_RDONLY | O_DIRECTORY | (state->dirfd == AT_FDCWD ? 0 : O_NOFOLLOW));
+    if (fd < 0) extract_failed(name);
+    close(state->dirfd);
+    state->dirfd = fd;
+}
+
+// Recreates directory inum under the host directory state->dirfd holds.
+// The walk keeps its own stack and holds one directory open at a time,
+// going back up through "..", so any nesting a checked image can hold is
+// extracted.
+void extract_tree(extract_state *state, uint inum) {
+    uint depth = 0, capacity = 64;
+    extract_frame *stack = malloc(capacity * sizeof(extract_frame));
+    mem_account(MEM_EXTRACT, capacity * sizeof(extract_frame));
+    state->entered[inum] = true;
+    extract_enter(state, &stack, &depth, &capacity, inum);
+
+    while (depth > 0) {
+        extract_frame *frame = &stack[depth - 1];
+        if (frame->next == frame->count) {
+            free(frame->entries);
+            if (--depth == 0) break;
+            extract_change_directory(state, "..");
+            struct stat st;
+            if (fstat(state->dirfd, &st) < 0 || st.st_dev != stack[depth - 1].dev || st.st_ino != stack[depth - 1].ino) {
+                fprintf(stderr, "extract failed: a directory was moved during extraction\n");
+                exit(1);
+            }
+            continue;
+        }
+
+        struct dirent *entry = &frame->entries[frame->next++];
+        // Devices have no host equivalent; files were copied on entry
+        if (state->inodes[entry->inum].type != INODE_DIR || state->entered[entry->inum]) continue;
+        state->entered[entry->inum] = true;
+
+        char name[DIRSIZ + 1];
+        extract_name(entry, name);
+        if (mkdirat(state->dirfd, name, 0755) < 0) extract_failed(name);
+        extract_change_directory(state, name);
+        extract_enter(state, &stack, &depth, &capacity, entry->inum);
+    }
+    free(stack);
+}
+
+// Extracts the file or subtree at path to dest on the host. The files of
+// each directory are copied in parallel once the directory is created.
+void extract_path(img_pointers *image, const char *path, const char *dest) {
+    extract_state state = { image, (struct dinode *)block_addr(image, 2), AT_FDCWD, NULL, 0, 0,
+                            xcalloc(MEM_EXTRACT, image->sb->ninodes, sizeof(bool)) };
+
+    uint inum = lookup_path(image, path);
+    if (inum == 0) {
+        fprintf(stderr, "path not found in image: %s\n", path);
+        exit(1);
+    }
+
+    if (state.inodes[inum].type == INODE_FILE) {
+        extract_file(image, &state.inodes[inum], AT_FDCWD, dest);
+    } else if (state.inodes[inum].type == INODE_DIR) {
+        if (mkdir(dest, 0755) < 0 && errno != EEXIST) extract_failed(dest);
+        extract_change_directory(&state, dest);
+        extract_tree(&state, inum);
+        close(state.dirfd);
+    }
+
+    free(state.jobs);
+    free(state.entered);
+}
+
+// Builds the reverse block map: for each data block, the inode that owns
+// it (as a direct, indirect or listed block), or 0 if no inode does.
+// Indexed by address - data_start. Only valid on a checked image.
+uint *build_block_owner_map(img_pointers *image) {
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    uint data_start = image->geo.data_start;
+    uint *owners = xcalloc(MEM_REVERSE_MAP, image->sb->nblocks, sizeof(uint));
+    uint addresses[MAXFILE];
+
+    for (uint inum = 0; inum < image->sb->ninodes; inum++) {
+        if (inodes[inum].type == 0) continue;
+        uint nslots = decode_block_map(image, &inodes[inum], addresses);
+        for (uint slot = 0; slot < nslots; slot++) {
+            if (addresses[slot] != 0) owners[addresses[slot] - data_start] = inum;
+        }
+        if (inodes[inum].addrs[NDIRECT] != 0) {
+            owners[inodes[inum].addrs[NDIRECT] - data_start] = inum;
+        }
+    }
+    return owners;
+}
+
+uint (*crc32c)(uint crc, const unsigned char *data, size_t length) = crc32c_software;
+
+// Builds the table and picks the CRC32C. The crc32 instruction comes with
+// SSE4.2, which is independent of the vector width, so any set but the
+// forced generic one uses it when the CPU has it.
+void crc32c_init(void) {
+    for (uint byte = 0; byte < 256; byte++) {
+        uint crc = byte;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc32c_table[byte] = crc;
+    }
+#if defined(__x86_64__)
+    if (active_kernels != &kernel_sets[0] && __builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#endif
+}
+
+#define SEAL_MAGIC "FCKSEAL1"
+
+// Sidecar layout: magic, then size, nblocks and ninodes from the superblock,
+// then one (block, crc32c) pair per allocated data block in address order.
+typedef struct _seal_header {
+    char magic[8];
+    uint size;
+    uint nblocks;
+    uint ninodes;
+    uint count;
+} seal_header;
+
+typedef struct _seal_entry {
+    uint block;
+    uint crc;
+} seal_entry;
+
+typedef struct _seal_state {
+    img_pointers *image;
+    seal_entry *entries;
+    bool *mismatched;
+} seal_state;
+
+void seal_checksum_blocks(void *ctx, uint begin, uint end) {
+    seal_state *state = ctx;
+    for (uint idx = begin; idx < end; idx++) {
+        seal_entry *entry = &state->entries[idx];
+        uint crc = crc32c(0, (unsigned char *)block_addr(state->image, entry->block), BLOCK_SIZE);
+        if (state->mismatched != NULL) {
+            state->mismatched[idx] = crc != entry->crc;
+        } else {
+            entry->crc = crc;
+        }
+    }
+}
+
+// Writes CRC32C values of every data block the bitmap marks allocated.
+void seal_image(img_pointers *image, const char *seal_path) {
+    char *bitmapblocks = block_addr(image, 2 + image->geo.ninodeblocks);
+    seal_header header = { SEAL_MAGIC, image->sb->size, image->sb->nblocks, image->sb->ninodes, 0 };
+    seal_state state = { image, xcalloc(MEM_SEAL, image->sb->nblocks, sizeof(seal_entry)), NULL };
+
+    for (uint idx = 0; idx < image->sb->nblocks; idx++) {
+        if (is_bit_set(bitmapblocks, image->geo.data_start + idx)) {
+            state.entries[header.count++].block = image->geo.data_start + idx;
+        }
+    }
+    parallel_for("seal checksums", header.count, 256, seal_checksum_blocks, &state);
+
+    FILE *file = fopen(seal_path, "wb");
+    if (file == NULL
+        || fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(state.entries, sizeof(seal_entry), header.count, file) != header.count
+        || fclose(file) != 0) {
+        perror(seal_path);
+        exit(1);
+    }
+    free(state.entries);
+}
+
+// Re-verifies a seal and reports every block whose contents changed, with
+// the inode that owns it. Exits with 1 if any block mismatches.
+void verify_seal(img_pointers *image, const char *seal_path) {
+    seal_header header;
+    FILE *file = fopen(seal_path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "seal not found: %s\n", seal_path);
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SEAL_MAGIC, 8) != 0
+        || header.size != image->sb->size || header.nblocks != image->sb->nblocks
+        || header.ninodes != image->sb->ninodes || header.count > header.nblocks) {
+        exit_with_error("seal does not match image.");
+    }
+
+    seal_state state = { image, xcalloc(MEM_SEAL, header.count + 1, sizeof(seal_entry)), xcalloc(MEM_SEAL, header.count + 1, sizeof(bool)) };
+    if (fread(state.entries, sizeof(seal_entry), header.count, file) != header.count) {
+        exit_with_error("seal does not match image.");
+    }
+    fclose(file);
+
+    for (uint idx = 0; idx < header.count; idx++) {
+        if (classify_block(&image->geo, state.entries[idx].block) != REGION_DATA) {
+            exit_with_error("seal does not match image.");
+        }
+    }
+    parallel_for("seal checksums", header.count, 256, seal_checksum_blocks, &state);
+
+    uint *owners = build_block_owner_map(image);
+    bool failed = false;
+    for (uint idx = 0; idx < header.count; idx++) {
+        if (!state.mismatched[idx]) continue;
+        uint block = state.entries[idx].block;
+        fprintf(stderr, "ERROR: checksum mismatch in block %u (inode %u).\n", block, owners[block - image->geo.data_start]);
+        failed = true;
+    }
+
+    free(owners);
+    free(state.entries);
+    free(state.mismatched);
+    if (failed) exit(1);
+}
+
+typedef struct _diff_state {
+    img_pointers *a;
+    img_pointers *b;
+    unsigned char *differs;  // per block of the larger image: 1 if the two images differ
+} diff_state;
+
+// A block past the end of one image counts as differing.
+void diff_compare_blocks(void *ctx, uint begin, uint end) {
+    diff_state *state = ctx;
+    for (uint block = begin; block < end; block++) {
+        state->differs[block] = block >= state->a->sb->size || block >= state->b->sb->size
+            || memcmp(block_addr(state->a, block), block_addr(state->b, block), BLOCK_SIZE) != 0;
+    }
+}
+
+// True if every address of the inode lies in the data region, so its
+// blocks can be decoded even though the image has not been checked.
+bool inode_addresses_sane(img_pointers *image, struct dinode *inode) {
+    for (int idx = 0; idx <= NDIRECT; idx++) {
+        if (inode->addrs[idx] != 0 && classify_block(&image->geo, inode->addrs[idx]) != REGION_DATA) return false;
+    }
+    if (inode->addrs[NDIRECT] == 0) return true;
+
+    uint *indirect = (uint *)block_addr(image, inode->addrs[NDIRECT]);
+    for (int idx = 0; idx < NINDIRECT; idx++) {
+        if (indirect[idx] != 0 && classify_block(&image->geo, indirect[idx]) != REGION_DATA) return false;
+    }
+    return true;
+}
+
+// Diagnostics. The checks note the inode and block they are looking at in
+// current_site; when an error is reported, the inode's path is rebuilt from
+// parent_map, one uint per inode filled in by the directory traversal. If
+// the error comes before the traversal, the parents are found then by a
+// bounds-checked walk, so the success path pays for nothing else.
+img_pointers *diagnostic_image = NULL;
+
+// Returns the lowest inode whose block map holds block, or 0.
+uint find_block_user(img_pointers *image, uint block) {
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    uint addresses[MAXFILE];
+
+    for (uint inum = 1; inum < image->sb->ninodes; inum++) {
+        if (inodes[inum].type == 0 || !inode_addresses_sane(image, &inodes[inum])) continue;
+        if (inodes[inum].addrs[NDIRECT] == block) return inum;
+        uint nslots = decode_block_map(image, &inodes[inum], addresses);
+        for (uint slot = 0; slot < nslots; slot++) {
+            if (addresses[slot] == block) return inum;
+        }
+    }
+    return 0;
+}
+
+// Finds each inode's parent by a walk from the root that skips directories
+// whose addresses are out of range, for errors found before the traversal.
+uint *find_parents(img_pointers *image) {
+    uint ninodes = image->sb->ninodes;
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    uint *parents = xcalloc(MEM_INODE_REFS, ninodes, sizeof(uint));
+    uint *queue = xcalloc(MEM_INODE_REFS, ninodes, sizeof(uint));
+    uint head = 0, tail = 0;
+
+    parents[ROOTINO] = ROOTINO;
+    queue[tail++] = ROOTINO;
+    while (head < tail) {
+        uint dir = queue[head++];
+        if (inodes[dir].type != INODE_DIR || !inode_addresses_sane(image, &inodes[dir])) continue;
+
+        uint nentries;
+        struct dirent *entries = list_directory(image, &inodes[dir], &nentries);
+        for (uint idx = 0; idx < nentries; idx++) {
+            uint child = entries[idx].inum;
+            if (child >= ninodes || parents[child] != 0) continue;
+            parents[child] = dir;
+            if (inodes[child].type == INODE_DIR && tail < ninodes) queue[tail++] = child;
+        }
+        free(entries);
+    }
+    free(queue);
+    return parents;
+}
+
+// Rebuilds the path of inum into buffer, looking up each name in its parent.
+const char *diagnostic_path(img_pointers *image, uint *parents, uint inum, char *buffer, size_t length) {
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    char *end = buffer + length - 1;
+    *end = '\0';
+    if (inum == ROOTINO) return "/";
+
+    for (uint depth = 0; inum != ROOTINO; depth++) {
+        if (depth == image->sb->ninodes || inum >= image->sb->ninodes || parents[inum] == 0) return "not reachable from /";
+        uint parent = parents[inum], nentries;
+        if (!inode_addresses_sane(image, &inodes[parent])) return "not reachable from /";
+
+        struct dirent *entries = list_directory(image, &inodes[parent], &nentries);
+        uint idx = 0;
+        while (idx < nentries && entries[idx].inum != inum) idx++;
+        size_t name_length = idx < nentries ? strnlen(entries[idx].name, DIRSIZ) : 0;
+        if (idx == nentries || (size_t)(end - buffer) < name_length + 1) {
+            free(entries);
+            return idx == nentries ? "not reachable from /" : "path too long";
+        }
+        end -= name_length;
+        memcpy(end, entries[idx].name, name_length);
+        *--end = '/';
+        free(entries);
+        inum = parent;
+    }
+    return end;
+}
+
+// Prints the inode, its path and the block of the error being reported,
+// with the region of a block that lies in the file system's metadata.
+void print_error_site(void) {
+    error_site site = current_site;
+    img_pointers *image = diagnostic_image;
+    char buffer[4096];
+
+    if (image == NULL || (site.inum == 0 && site.block == 0)) return;
+    // Nothing below may report an error again
+    diagnostic_image = NULL;
+
+    if (site.inum == 0) site.inum = find_block_user(image, site.block);
+    fprintf(stderr, "  ");
+    if (site.inum != 0) {
+        uint *parents = parent_map != NULL ? parent_map : find_parents(image);
+        fprintf(stderr, "inode %u (%s)", site.inum, diagnostic_path(image, parents, site.inum, buffer, sizeof(buffer)));
+    }
+    if (site.block != 0) fprintf(stderr, "%sblock %u", site.inum != 0 ? ", " : "", site.block);
+    enum block_region region = classify_block(&image->geo, site.block);
+    if (site.block != 0 && region != REGION_DATA && region != REGION_OUTSIDE) {
+        fprintf(stderr, " (%s)", region_names[region]);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Duplicate data block report. Every allocated data block is hashed by the
+// workers, which count it in an open-addressing table, claiming empty slots
+// with compare-and-swap on the 64-bit hash. Groups that hashed alike are then
+// confirmed byte for byte and listed with the inodes that own their blocks.
+typedef struct _dedup_slot {
+    uint64_t hash;      // 0 marks an empty slot
+    uint count;         // blocks that hashed here
+    uint group;         // index into the groups once they are laid out
+} dedup_slot;
+
+typedef struct _dedup_state {
+    img_pointers *image;
+    uint *blocks;       // allocated data blocks, ascending
+    uint64_t *hashes;   // content hash of each of blocks
+    dedup_slot *slots;
+    uint64_t mask;
+} dedup_state;
+
+typedef struct _dedup_group {
+    uint first;         // offset of the group's blocks in members
+    uint count;         // blocks confirmed identical to the first
+    uint lowest;        // first of the group's blocks, for a stable order
+} dedup_group;
+
+// Finds the slot for hash, claiming an empty one if it is not yet present.
+dedup_slot *dedup_slot_for(dedup_state *state, uint64_t hash) {
+    for (uint64_t idx = hash & state->mask;; idx = (idx + 1) & state->mask) {
+        dedup_slot *slot = &state->slots[idx];
+        uint64_t seen = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+        // A failed exchange leaves the hash that won the slot in seen
+        if (seen == 0 && __atomic_compare_exchange_n(&slot->hash, &seen, hash, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+        if (seen == hash) return slot;
+    }
+}
+
+void dedup_hash_blocks(void *ctx, uint begin, uint end) {
+    dedup_state *state = ctx;
+    for (uint idx = begin; idx < end; idx++) {
+        uint64_t hash = hash_bytes(block_addr(state->image, state->blocks[idx]), BLOCK_SIZE, 0);
+        if (hash == 0) hash = 1;
+        state->hashes[idx] = hash;
+        __atomic_fetch_add(&dedup_slot_for(state, hash)->count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Orders groups by bytes reclaimable, largest first.
+int compare_dedup_groups(const void *a, const void *b) {
+    const dedup_group *group_a = a, *group_b = b;
+    if (group_a->count != group_b->count) return group_a->count < group_b->count ? 1 : -1;
+    return group_a->lowest < group_b->lowest ? -1 : group_a->lowest > group_b->lowest;
+}
+
+void print_dedup_report(img_pointers *image) {
+    char *bitmapblocks = block_addr(image, 2 + image->geo.ninodeblocks);
+    uint data_start = image->geo.data_start;
+    uint count = 0;
+    uint64_t capacity = 16;
+    dedup_state state = { image, xcalloc(MEM_DEDUP, image->sb->nblocks + 1, sizeof(uint)), NULL, NULL, 0 };
+
+    for (uint idx = 0; idx < image->sb->nblocks; idx++) {
+        if (is_bit_set(bitmapblocks, data_start + idx)) state.blocks[count++] = data_start + idx;
+    }
+    while (capacity < 2 * (uint64_t)count) capacity <<= 1;
+    state.hashes = xcalloc(MEM_DEDUP, count + 1, sizeof(uint64_t));
+    state.slots = xcalloc(MEM_DEDUP, capacity, sizeof(dedup_slot));
+    state.mask = capacity - 1;
+    parallel_for("dedup hashes", count, 256, dedup_hash_blocks, &state);
+
+    // Lay the candidate groups out contiguously, blocks in ascending order
+    uint ngroups = 0, nmembers = 0, distinct = 0;
+    for (uint64_t idx = 0; idx < capacity; idx++) {
+        if (state.slots[idx].hash != 0) distinct++;
+        if (state.slots[idx].count > 1) state.slots[idx].group = ngroups++;
+    }
+    dedup_group *groups = xcalloc(MEM_DEDUP, ngroups + 1, sizeof(dedup_group));
+    uint *members = xcalloc(MEM_DEDUP, count + 1, sizeof(uint));
+    for (uint64_t idx = 0; idx < capacity; idx++) {
+        if (state.slots[idx].count < 2) continue;
+        groups[state.slots[idx].group].first = nmembers;
+        nmembers += state.slots[idx].count;
+    }
+    for (uint idx = 0; idx < count; idx++) {
+        dedup_slot *slot = dedup_slot_for(&state, state.hashes[idx]);
+        if (slot->count < 2) continue;
+        dedup_group *group = &groups[slot->group];
+        members[group->first + group->count++] = state.blocks[idx];
+    }
+
+    // Blocks whose hash collided without matching the first are left out
+    uint64_t reclaimable = 0;
+    for (uint idx = 0; idx < ngroups; idx++) {
+        uint *group = &members[groups[idx].first], kept = 1;
+        char *first = block_addr(image, group[0]);
+        for (uint member = 1; member < groups[idx].count; member++) {
+            if (memcmp(first, block_addr(image, group[member]), BLOCK_SIZE) == 0) group[kept++] = group[member];
+        }
+        groups[idx].count = kept;
+        groups[idx].lowest = group[0];
+        reclaimable += (uint64_t)(kept - 1) * BLOCK_SIZE;
+    }
+    qsort(groups, ngroups, sizeof(dedup_group), compare_dedup_groups);
+    while (ngroups > 0 && groups[ngroups - 1].count < 2) ngroups--;
+
+    printf("dedup: %u data blocks, %u distinct, %u duplicate groups, %llu bytes reclaimable\n",
+           count, distinct, ngroups, (unsigned long long)reclaimable);
+    uint *owners = build_block_owner_map(image);
+    uint *parents = ngroups > 0 ? find_parents(image) : NULL;
+    char path[4096];
+    for (uint idx = 0; idx < ngroups; idx++) {
+        printf("group %u: %u blocks, %llu bytes reclaimable\n", idx + 1, groups[idx].count,
+               (unsigned long long)(groups[idx].count - 1) * BLOCK_SIZE);
+        for (uint member = 0; member < groups[idx].count; member++) {
+            uint block = members[groups[idx].first + member], inum = owners[block - data_start];
+            printf("  block %u  inode %u (%s)\n", block, inum, diagnostic_path(image, parents, inum, path, sizeof(path)));
+        }
+    }
+
+    free(parents);
+    free(owners);
+    free(members);
+    free(groups);
+    free(state.slots);
+    free(state.hashes);
+    free(state.blocks);
+}
+
+// True if the inode or any block it lists differs between the images.
+bool inode_blocks_differ(diff_state *state, uint inum) {
+    struct dinode *inode_a = (struct dinode *)block_addr(state->a, 2) + inum;
+    struct dinode *inode_b = (struct dinode *)block_addr(state->b, 2) + inum;
+    uint addresses[MAXFILE];
+
+    if (memcmp(inode_a, inode_b, sizeof(struct dinode)) != 0) return true;
+    if (inode_a->addrs[NDIRECT] != 0 && state->differs[inode_a->addrs[NDIRECT]]) return true;
+
+    uint nslots = decode_block_map(state->a, inode_a, addresses);
+    for (uint slot = 0; slot < nslots; slot++) {
+        if (addresses[slot] != 0 && state->differs[addresses[slot]]) return true;
+    }
+    return false;
+}
+
+// Prints entries added, removed or repointed between two versions of a directory.
+void diff_directory(diff_state *state, uint inum) {
+    struct dinode *inode_a = (struct dinode *)block_addr(state->a, 2) + inum;
+    struct dinode *inode_b = (struct dinode *)block_addr(state->b, 2) + inum;
+    uint count_a = 0, count_b = 0;
+    struct dirent *entries_a = list_directory(state->a, inode_a, &count_a);
+    struct dirent *entries_b = list_directory(state->b, inode_b, &count_b);
+
+    // Both listings are sorted by name, so one merge pass pairs them up
+    uint idx_a = 0, idx_b = 0;
+    while (idx_a < count_a || idx_b < count_b) {
+        int order = idx_a == count_a ? 1 : idx_b == count_b ? -1 : compare_dirent_names(&entries_a[idx_a], &entries_b[idx_b]);
+        if (order < 0) {
+            printf("dirent %u/%.*s: removed (was inode %u)\n", inum, DIRSIZ, entries_a[idx_a].name, entries_a[idx_a].inum);
+            idx_a++;
+        } else if (order > 0) {
+            printf("dirent %u/%.*s: added (inode %u)\n", inum, DIRSIZ, entries_b[idx_b].name, entries_b[idx_b].inum);
+            idx_b++;
+        } else {
+            if (entries_a[idx_a].inum != entries_b[idx_b].inum) {
+                printf("dirent %u/%.*s: inode %u -> %u\n", inum, DIRSIZ, entries_a[idx_a].name,
+                       entries_a[idx_a].inum, entries_b[idx_b].inum);
+            }
+            idx_a++;
+            idx_b++;
+        }
+    }
+    free(entries_a);
+    free(entries_b);
+}
+
+// Prints how one inode changed. Returns true if it changed at all.
+bool diff_inode(uint inum, struct dinode *inode_a, struct dinode *inode_b) {
+    if (memcmp(inode_a, inode_b, sizeof(struct dinode)) == 0) return false;
+
+    if (inode_a->type == 0) {
+        printf("inode %u: added (type %d, size %u)\n", inum, inode_b->type, inode_b->size);
+    } else if (inode_b->type == 0) {
+        printf("inode %u: removed (type %d, size %u)\n", inum, inode_a->type, inode_a->size);
+    } else {
+        printf("inode %u: modified", inum);
+        if (inode_a->type != inode_b->type) printf(" type %d -> %d", inode_a->type, inode_b->type);
+        if (inode_a->nlink != inode_b->nlink) printf(" nlink %d -> %d", inode_a->nlink, inode_b->nlink);
+        if (inode_a->size != inode_b->size) printf(" size %u -> %u", inode_a->size, inode_b->size);
+        if (memcmp(inode_a->addrs, inode_b->addrs, sizeof(inode_a->addrs)) != 0) printf(" addrs");
+        if (inode_a->major != inode_b->major || inode_a->minor != inode_b->minor) printf(" device");
+        printf("\n");
+    }
+    return true;
+}
+
+// Compares two images block by block and decodes only the blocks that
+// differ: superblock fields, inodes, bitmap bits and directory entries.
+// Blocks are compared across the worker threads. Returns true if the
+// images differ.
+bool diff_images(img_pointers *a, img_pointers *b) {
+    struct superblock *sb_a = a->sb, *sb_b = b->sb;
+    uint nblocks = sb_a->size > sb_b->size ? sb_a->size : sb_b->size;
+    diff_state state = { a, b, xcalloc(MEM_DIFF, nblocks, 1) };
+    bool changed = false;
+
+    if (memcmp(sb_a, sb_b, sizeof(struct superblock)) != 0) {
+        printf("superblock: size %u -> %u, nblocks %u -> %u, ninodes %u -> %u\n",
+               sb_a->size, sb_b->size, sb_a->nblocks, sb_b->nblocks, sb_a->ninodes, sb_b->ninodes);
+        changed = true;
+    }
+    if (a->geo.data_start != b->geo.data_start) {
+        // Different layouts: only a block count is meaningful
+        parallel_for("diff blocks", nblocks, 1024, diff_compare_blocks, &state);
+        uint ndiffer = 0;
+        for (uint block = 0; block < nblocks; block++) ndiffer += state.differs[block];
+        printf("layout differs; %u of %u blocks differ\n", ndiffer, nblocks);
+        free(state.differs);
+        return true;
+    }
+
+    parallel_for("diff blocks", nblocks, 1024, diff_compare_blocks, &state);
+
+    // Inodes, one inode-table block at a time
+    uint ninodes = sb_a->ninodes < sb_b->ninodes ? sb_a->ninodes : sb_b->ninodes;
+    struct dinode *inodes_a = (struct dinode *)block_addr(a, 2);
+    struct dinode *inodes_b = (struct dinode *)block_addr(b, 2);
+    for (uint inum = 0; inum < ninodes; inum++) {
+        if (!state.differs[2 + inum / IPB]) {
+            inum += IPB - 1 - inum % IPB;
+            continue;
+        }
+        changed |= diff_inode(inum, &inodes_a[inum], &inodes_b[inum]);
+    }
+
+    // Allocation changes in the data region
+    char *bitmap_a = block_addr(a, 2 + a->geo.ninodeblocks);
+    char *bitmap_b = block_addr(b, 2 + b->geo.ninodeblocks);
+    uint data_end_a = a->geo.region_end[REGION_DATA], data_end_b = b->geo.region_end[REGION_DATA];
+    uint data_end = data_end_a > data_end_b ? data_end_a : data_end_b;
+    for (uint block = a->geo.data_start; block < data_end; block++) {
+        if (!state.differs[2 + a->geo.ninodeblocks + block / BPB]) {
+            block += BPB - 1 - block % BPB;
+            continue;
+        }
+        bool used_a = block < data_end_a && is_bit_set(bitmap_a, block);
+        bool used_b = block < data_end_b && is_bit_set(bitmap_b, block);
+        if (used_a != used_b) {
+            printf("block %u: %s\n", block, used_b ? "allocated" : "freed");
+            changed = true;
+        }
+    }
+
+    // Directory entries, for directories present in both images whose
+    // inode or blocks changed
+    for (uint inum = 1; inum < ninodes; inum++) {
+        if (inodes_a[inum].type != INODE_DIR || inodes_b[inum].type != INODE_DIR) continue;
+        if (!inode_addresses_sane(a, &inodes_a[inum]) || !inode_addresses_sane(b, &inodes_b[inum])) continue;
+        if (inode_blocks_differ(&state, inum)) diff_directory(&state, inum);
+    }
+
+    uint ndata = 0;
+    for (uint block = a->geo.data_start; block < data_end; block++) ndata += state.differs[block];
+    if (ndata > 0) {
+        printf("data: %u blocks differ\n", ndata);
+        changed = true;
+    }
+
+    free(state.differs);
+    return changed;
+}
+
+typedef struct _manifest_line {
+    char *path;
+    uint inum;
+    uint64_t hash;
+    bool mismatched;
+} manifest_line;
+
+typedef struct _manifest_state {
+    img_pointers *image;
+    manifest_line *hashed;
+    uint nhashed;
+} manifest_state;
+
+void manifest_hash_files(void *ctx, uint begin, uint end) {
+    manifest_state *state = ctx;
+    struct dinode *inodes = (struct dinode *)block_addr(state->image, 2);
+    for (uint idx = begin; idx < end; idx++) {
+        manifest_line *line = &state->hashed[idx];
+        line->mismatched = hash_leaf(state->image, &inodes[line->inum]) != line->hash;
+    }
+}
+
+const char *inode_type_name(short type) {
+    switch (type) {
+    case INODE_DIR: return "dir";
+    case INODE_FILE: return "file";
+    case INODE_DEV: return "dev";
+    default: return "unknown";
+    }
+}
+
+// Verifies the image against a manifest of "<path> <type> <size> [<hash>]"
+// lines, where type is file, dir or dev, size may be "-" and hash is the
+// value --digest prints. Paths are looked up in the index built by the
+// traversal. Reports every missing, unexpected or mismatched path and
+// exits with 1 if there was any.
+void verify_manifest(img_pointers *image, path_index *index, const char *manifest_path) {
+    FILE *file = fopen(manifest_path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "manifest not found: %s\n", manifest_path);
+        exit(1);
+    }
+
+    struct dinode *inodes = (struct dinode *)block_addr(image, 2);
+    manifest_state state = { image, NULL, 0 };
+    uint capacity = 0;
+    bool failed = false;
+    char line[4096], path[4096], type[16], size[32], hash[32];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        int fields = sscanf(line, "%4095s %15s %31s %31s", path, type, size, hash);
+        if (fields < 3) {
+            fprintf(stderr, "ERROR: manifest: malformed line: %s", line);
+            failed = true;
+            continue;
+        }
+        if (strcmp(path, "/") == 0) continue;
+
+        path_entry *entry = path_index_find(index, path);
+        if (entry == NULL) {
+            fprintf(stderr, "ERROR: manifest: missing %s\n", path);
+            failed = true;
+            continue;
+        }
+        entry->seen = true;
+
+        struct dinode *inode = &inodes[entry->inum];
+        if (strcmp(type, inode_type_name(inode->type)) != 0) {
+            fprintf(stderr, "ERROR: manifest: %s is a %s, expected %s\n", path, inode_type_name(inode->type), type);
+            failed = true;
+        }
+        if (strcmp(size, "-") != 0 && strtoull(size, NULL, 10) != inode->size) {
+            fprintf(stderr, "ERROR: manifest: %s has size %u, expected %s\n", path, inode->size, size);
+            failed = true;
+        }
+        if (fields == 4 && inode->type != INODE_DIR) {
+            if (state.nhashed == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                state.hashed = realloc(state.hashed, capacity * sizeof(manifest_line));
+            }
+            manifest_line *hashed = &state.hashed[state.nhashed++];
+            hashed->path = strdup(path);
+            hashed->inum = entry->inum;
+            hashed->hash = strtoull(hash, NULL, 16);
+        }
+    }
+    fclose(file);
+
+    parallel_for("manifest hashes", state.nhashed, 16, manifest_hash_files, &state);
+    for (uint idx = 0; idx < state.nhashed; idx++) {
+        if (state.hashed[idx].mismatched) {
+            fprintf(stderr, "ERROR: manifest: %s contents differ\n", state.hashed[idx].path);
+            failed = true;
+        }
+        free(state.hashed[idx].path);
+    }
+    free(state.hashed);
+
+    for (uint64_t slot = 0; slot < index->capacity; slot++) {
+        if (index->slots[slot].path != NULL && !index->slots[slot].seen) {
+            fprintf(stderr, "ERROR: manifest: unexpected %s\n", index->slots[slot].path);
+            failed = true;
+        }
+    }
+
+    if (failed) exit(1);
+}
+
+// Secure-wipe audits (--audit-free-inodes, --audit-free-blocks). Each
+// records the lowest offending inode or block so the report does not
+// depend on thread timing.
+typedef struct _zero_audit {
+    img_pointers *image;
+    char *bitmapblocks;
+    uint first_bad;   // UINT32_MAX if none
+} zero_audit;
+
+void record_audit_failure(zero_audit *audit, uint index) {
+    uint current = __atomic_load_n(&audit->first_bad, __ATOMIC_RELAXED);
+    while (index < current && !__atomic_compare_exchange_n(&audit->first_bad, &current, index, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Checks that every free dinode in inode blocks [begin, end) is all zeros.
+void audit_inode_blocks(void *ctx, uint begin, uint end) {
+    zero_audit *audit = ctx;
+    uint ninodes = audit->image->sb->ninodes;
+
+    for (uint block = begin; block < end; block++) {
+        struct dinode *inode = (struct dinode *)block_addr(audit->image, 2 + block);
+        // A fully zeroed block holds only clean free inodes
+        if (active_kernels->is_zero(inode, BLOCK_SIZE)) continue;
+        for (uint idx = 0; idx < IPB && block * IPB + idx < ninodes; idx++, inode++) {
+            if (inode->type == 0 && !active_kernels->is_zero(inode, sizeof(struct dinode))) {
+                record_audit_failure(audit, block * IPB + idx);
+                return;
+            }
+        }
+    }
+}
+
+void audit_free_inodes(img_pointers *image) {
+    zero_audit audit = { image, NULL, UINT32_MAX };
+    uint nblocks = (image->sb->ninodes + IPB - 1) / IPB;
+    parallel_for("audit free inodes", nblocks, 64, audit_inode_blocks, &audit);
+
+    if (audit.first_bad != UINT32_MAX) {
+        char message[64];
+        snprintf(message, sizeof(message), "free inode %u is not zeroed.", audit.first_bad);
+        current_site = (error_site){ 0, 2 + audit.first_bad / IPB };
+        exit_with_error(message);
+    }
+}
+
+// Checks that free data blocks in [begin, end) of the data region are zero.
+// Ranges the file system reports as holes are skipped without being read.
+void audit_data_blocks(void *ctx, uint begin, uint end) {
+    zero_audit *audit = ctx;
+    img_pointers *image = audit->image;
+    uint start = image->geo.data_start;
+    uint block = start + begin, last = start + end;
+
+    while (block < last) {
+        uint data_end = last;
+        off_t data = lseek(image->fd, image->base + ((off_t)block << image->geo.block_shift), SEEK_DATA);
+        if (data < 0 && errno == ENXIO) return; // Only a hole remains
+        if (data >= 0) {
+            uint64_t first = (uint64_t)(data - image->base) >> image->geo.block_shift;
+            if (first > block) {
+                block = first;
+                continue;
+            }
+            off_t hole = lseek(image->fd, image->base + ((off_t)block << image->geo.block_shift), SEEK_HOLE);
+            if (hole >= 0) {
+                uint64_t hole_block = ((uint64_t)(hole - image->base) + BLOCK_SIZE - 1) >> image->geo.block_shift;
+                if (hole_block < data_end) data_end = hole_block;
+            }
+        }
+
+        for (; block < data_end; block++) {
+            if (!is_bit_set(audit->bitmapblocks, block) && !active_kernels->is_zero(block_addr(image, block), BLOCK_SIZE)) {
+                record_audit_failure(audit, block);
+                return;
+            }
+        }
+    }
+}
+
+void audit_free_blocks(img_pointers *image) {
+    zero_audit audit = { image, block_addr(image, 2 + image->geo.ninodeblocks), UINT32_MAX };
+    parallel_for("audit free blocks", image->sb->nblocks, 4096, audit_data_blocks, &audit);
+
+    if (audit.first_bad != UINT32_MAX) {
+        char message[64];
+        snprintf(message, sizeof(message), "free block %u is not zeroed.", audit.first_bad);
+        current_site = (error_site){ 0, audit.first_bad };
+        exit_with_error(message);
+    }
+}
+
+// In-memory indices for the query shell. They are built by a bounds-checked
+// walk of their own, so they are usable on images that fail the check.
+void check_image(img_pointers *image);
+void check_release(void);
+
+typedef struct _shell_indices {
+    img_pointers *image;
+    struct dinode *inodes;
+    uint ninodes;
+    path_index paths;          // path -> inode
+    uint *parents;             // inode -> parent directory (first link found)
+    char (*names)[DIRSIZ];     // inode -> name in its parent
+    uint *links;               // inode -> directory entries referring to it
+    uint *owners;              // data block -> owning inode, indexed from data_start
+    bool *shared;              // data block -> claimed by more than one inode
+    uint *block_offsets;       // inode -> first entry in block_lists
+    uint *block_lists;         // every inode's blocks, indirect block included
+} shell_indices;
+
+// Returns the number of the inode's blocks and whether all are in the data region.
+bool shell_inode_blocks(shell_indices *shell, uint inum, uint *addresses, uint *count) {
+    struct dinode *inode = &shell->inodes[inum];
+    *count = 0;
+    if (!inode_addresses_sane(shell->image, inode)) return false;
+
+    uint nslots = decode_block_map(shell->image, inode, addresses);
+    for (uint slot = 0; slot < nslots; slot++) {
+        if (addresses[slot] != 0) addresses[(*count)++] = addresses[slot];
+    }
+    if (inode->addrs[NDIRECT] != 0) addresses[(*count)++] = inode->addrs[NDIRECT];
+    return true;
+}
+
+void shell_build_indices(shell_indices *shell, img_pointers *image) {
+    uint addresses[MAXFILE + 1], count;
+    uint nblocks = image->sb->nblocks;
+
+    shell->image = image;
+    shell->inodes = (struct dinode *)block_addr(image, 2);
+    shell->ninodes = image->sb->ninodes;
+    shell->parents = xcalloc(MEM_SHELL, shell->ninodes, sizeof(uint));
+    shell->names = xcalloc(MEM_SHELL, shell->ninodes, DIRSIZ);
+    shell->links = xcalloc(MEM_SHELL, shell->ninodes, sizeof(uint));
+    shell->owners = xcalloc(MEM_SHELL, nblocks, sizeof(uint));
+    shell->shared = xcalloc(MEM_SHELL, nblocks, sizeof(bool));
+    shell->block_offsets = xcalloc(MEM_SHELL, shell->ninodes + 1, sizeof(uint));
+    path_index_init(&shell->paths, shell->ninodes);
+
+    // Reverse block map and per-inode block lists
+    uint total = 0;
+    for (uint inum = 0; inum < shell->ninodes; inum++) {
+        if (shell->inodes[inum].type != 0) {
+            shell_inode_blocks(shell, inum, addresses, &count);
+            total += count;
+        }
+    }
+    shell->block_lists = xcalloc(MEM_SHELL, total + 1, sizeof(uint));
+    for (uint inum = 0, next = 0; inum < shell->ninodes; inum++) {
+        shell->block_offsets[inum] = next;
+        if (shell->inodes[inum].type == 0) continue;
+        shell_inode_blocks(shell, inum, addresses, &count);
+        for (uint idx = 0; idx < count; idx++) {
+            uint slot = addresses[idx] - image->geo.data_start;
+            if (shell->owners[slot] != 0) shell->shared[slot] = true;
+            shell->owners[slot] = inum;
+            shell->block_lists[next++] = addresses[idx];
+        }
+        shell->block_offsets[inum + 1] = next;
+    }
+    shell->block_offsets[shell->ninodes] = total;
+
+    // Paths, parents and link counts, walking each directory once
+    uint *queue = xcalloc(MEM_SHELL, shell->ninodes, sizeof(uint));
+    uint head = 0, tail = 0;
+    queue[tail++] = ROOTINO;
+    shell->parents[ROOTINO] = ROOTINO;
+    while (head < tail) {
+        uint dir = queue[head++];
+        if (shell->inodes[dir].type != INODE_DIR || !inode_addresses_sane(image, &shell->inodes[dir])) continue;
+
+        uint nentries;
+        struct dirent *entries = list_directory(image, &shell->inodes[dir], &nentries);
+        for (uint idx = 0; idx < nentries; idx++) {
+            uint child = entries[idx].inum;
+            if (child >= shell->ninodes) continue;
+            shell->links[child]++;
+            path_index_record(&shell->paths, dir, &entries[idx], &shell->inodes[child]);
+            if (shell->parents[child] != 0) continue;
+            shell->parents[child] = dir;
+            memcpy(shell->names[child], entries[idx].name, DIRSIZ);
+            if (shell->inodes[child].type == INODE_DIR && tail < shell->ninodes) queue[tail++] = child;
+        }
+        free(entries);
+    }
+    free(queue);
+}
+
+void shell_free_indices(shell_indices *shell) {
+    path_index_free(&shell->paths, shell->ninodes);
+    free(shell->parents);
+    free(shell->names);
+    free(shell->links);
+    free(shell->owners);
+    free(shell->shared);
+    free(shell->block_offsets);
+    free(shell->block_lists);
+}
+
+// Rebuilds the path of an inode from the parent map into buffer.
+const char *shell_path(shell_indices *shell, uint inum, char *buffer, size_t length) {
+    char *end = buffer + length - 1;
+    *end = '\0';
+    if (inum == ROOTINO) return "/";
+
+    for (uint depth = 0; inum != ROOTINO && depth < shell->ninodes; depth++) {
+        if (inum >= shell->ninodes || shell->parents[inum] == 0) return "(unreachable)";
+        size_t name_length = strnlen(shell->names[inum], DIRSIZ);
+        if ((size_t)(end - buffer) < name_length + 1) return "(path too long)";
+        end -= name_length;
+        memcpy(end, shell->names[inum], name_length);
+        *--end = '/';
+        inum = shell->parents[inum];
+    }
+    return end;
+}
+
+// Parses an inode number or a path; returns 0 if neither resolves.
+uint shell_resolve(shell_indices *shell, const char *arg) {
+    if (arg == NULL) return ROOTINO;
+    if (arg[0] == '/') {
+        if (arg[1] == '\0') return ROOTINO;
+        path_entry *entry = path_index_find(&shell->paths, arg);
+        return entry != NULL ? entry->inum : 0;
+    }
+    char *end;
+    unsigned long inum = strtoul(arg, &end, 10);
+    return *end == '\0' && inum < shell->ninodes ? inum : 0;
+}
+
+void shell_stat(shell_indices *shell, uint inum) {
+    struct dinode *inode = &shell->inodes[inum];
+    char path[4096];
+    printf("inode %u: type %s (%d), nlink %d, links found %u, size %u, major %d, minor %d\n",
+           inum, inode_type_name(inode->type), inode->type, inode->nlink, shell->links[inum],
+           inode->size, inode->major, inode->minor);
+    printf("  path %s\n  blocks", shell_path(shell, inum, path, sizeof(path)));
+    for (uint idx = shell->block_offsets[inum]; idx < shell->block_offsets[inum + 1]; idx++) {
+        printf(" %u", shell->block_lists[idx]);
+    }
+    printf("\n");
+}
+
+void shell_ls(shell_indices *shell, uint inum) {
+    struct dinode *dir = &shell->inodes[inum];
+    if (dir->type != INODE_DIR || !inode_addresses_sane(shell->image, dir)) {
+        printf("inode %u is not a readable directory\n", inum);
+        return;
+    }
+    uint count;
+    struct dirent *entries = list_directory(shell->image, dir, &count);
+    for (uint idx = 0; idx < count; idx++) {
+        struct dinode *child = entries[idx].inum < shell->ninodes ? &shell->inodes[entries[idx].inum] : NULL;
+        printf("%6u %-4s %10u %.*s\n", entries[idx].inum, child ? inode_type_name(child->type) : "bad",
+               child ? child->size : 0, DIRSIZ, entries[idx].name);
+    }
+    free(entries);
+}
+
+void shell_owner(shell_indices *shell, const char *arg) {
+    char path[4096];
+    char *end = NULL;
+    unsigned long value = arg != NULL ? strtoul(arg, &end, 10) : 0;
+    if (arg == NULL || end == arg || *end != '\0' || value > UINT32_MAX) {
+        printf("no such block: %s\n", arg != NULL ? arg : "");
+        return;
+    }
+    uint block = value;
+    enum block_region region = classify_block(&shell->image->geo, block);
+    if (region != REGION_DATA) {
+        printf("block %u: %s\n", block, region_names[region]);
+        return;
+    }
+    uint owner = shell->owners[block - shell->image->geo.data_start];
+    if (owner == 0) {
+        printf("block %u: data, not owned by any inode\n", block);
+        return;
+    }
+    printf("block %u: data, owned by inode %u (%s)%s\n", block, owner, shell_path(shell, owner, path, sizeof(path)),
+           shell->shared[block - shell->image->geo.data_start] ? ", also claimed by another inode" : "");
+}
+
+// Runs the per-inode checks (Points 1, 2, 4 and 5) and compares the inode
+// with the shell's indices for the global points (7, 8, 9-12).
+void shell_check(shell_indices *shell, uint inum) {
+    struct dinode *inode = &shell->inodes[inum];
+    char *bitmapblocks = block_addr(shell->image, 2 + shell->image->geo.ninodeblocks);
+    jmp_buf trap;
+    bool ok = true;
+
+    if (inode->type == 0) {
+        printf("inode %u: free%s\n", inum, shell->links[inum] > 0 ? ", but referred to in a directory" : "");
+        return;
+    }
+
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        validate_inode_type(inode);
+        validate_block_addresses(shell->image->sb, inode, shell->image);
+        if (inode->type == INODE_DIR) validate_directory_structure(inode, shell->image, inum);
+        validate_bitmap_addr(bitmapblocks, inode, shell->image);
+    } else {
+        printf("inode %u: %s\n", inum, trapped_error);
+        ok = false;
+    }
+    error_trap = NULL;
+    if (!ok) return;
+
+    for (uint idx = shell->block_offsets[inum]; idx < shell->block_offsets[inum + 1]; idx++) {
+        if (shell->shared[shell->block_lists[idx] - shell->image->geo.data_start]) {
+            printf("inode %u: block %u is used by another inode\n", inum, shell->block_lists[idx]);
+            ok = false;
+        }
+    }
+    if (inum != ROOTINO && shell->links[inum] == 0) {
+        printf("inode %u: marked in use but not found in a directory\n", inum);
+        ok = false;
+    }
+    if (inode->type == INODE_FILE && inode->nlink != shell->links[inum]) {
+        printf("inode %u: nlink %d but %u directory entries\n", inum, inode->nlink, shell->links[inum]);
+        ok = false;
+    }
+    if (inode->type == INODE_DIR && shell->links[inum] > 1) {
+        printf("inode %u: directory appears %u times\n", inum, shell->links[inum]);
+        ok = false;
+    }
+    if (ok) printf("inode %u: ok\n", inum);
+}
+
+// Interactive query shell: loads the image once, builds the indices, then
+// answers commands read from standard input.
+void run_shell(img_pointers *image) {
+    shell_indices shell;
+    jmp_buf trap;
+    char line[4096];
+
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        check_image(image);
+        printf("image is consistent\n");
+    } else {
+        printf("image check failed: %s\n", trapped_error);
+    }
+    error_trap = NULL;
+
+    shell_build_indices(&shell, image);
+
+    bool interactive = isatty(STDIN_FILENO);
+    for (;;) {
+        if (interactive) {
+            printf("fcheck> ");
+            fflush(stdout);
+        }
+        if (fgets(line, sizeof(line), stdin) == NULL) break;
+
+        char *command = strtok(line, " \t\n");
+        char *arg = strtok(NULL, " \t\n");
+        if (command == NULL) continue;
+
+        if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) {
+            break;
+        } else if (strcmp(command, "help") == 0) {
+            printf("stat <inum|path>  ls [inum|path]  owner <block>  path <inum>  check <inum|path>  quit\n");
+        } else if (strcmp(command, "owner") == 0) {
+            shell_owner(&shell, arg);
+        } else if (strcmp(command, "stat") == 0 || strcmp(command, "ls") == 0
+                   || strcmp(command, "path") == 0 || strcmp(command, "check") == 0) {
+            uint inum = shell_resolve(&shell, arg);
+            if (inum == 0) {
+                printf("no such inode or path: %s\n", arg != NULL ? arg : "");
+            } else if (command[0] == 's') {
+                shell_stat(&shell, inum);
+            } else if (command[0] == 'l') {
+                shell_ls(&shell, inum);
+            } else if (command[0] == 'p') {
+                char path[4096];
+                printf("%s\n", shell_path(&shell, inum, path, sizeof(path)));
+            } else {
+                shell_check(&shell, inum);
+            }
+        } else {
+            printf("unknown command: %s (try help)\n", command);
+        }
+        fflush(stdout);
+    }
+    shell_free_indices(&shell);
+}
+
+// Incremental verification (--replay, or the incremental_* functions when
+// fcheck.c is built with FCHECK_LIBRARY). The state mirrors what the full
+// check derives: per data block, how often in-use inodes reference it; per
+// inode, a snapshot of its block map, its local verdict (Points 1 to 4) and
+// the directory entries naming it. A block write updates only the blocks,
+// inodes and directory entries it touches, and each rule keeps a count of
+// the blocks or inodes violating it. Reachability from the root is walked
+// again only after a directory is linked or unlinked.
+enum incremental_rule {
+    RULE_BITMAP_FREE,      // Point 5
+    RULE_BITMAP_UNUSED,    // Point 6
+    RULE_DIRECT_TWICE,     // Point 7
+    RULE_INDIRECT_TWICE,   // Point 8
+    RULE_UNREFERENCED,     // Point 9
+    RULE_REFERENCED_FREE,  // Point 10
+    RULE_FILE_NLINK,       // Point 11
+    RULE_DIRECTORY_TWICE,  // Point 12
+    RULE_DIRECTORY_NLINK,
+    RULE_COUNT
+};
+
+const char *incremental_rule_messages[RULE_COUNT] = {
+    "address used by inode but marked free in bitmap.",
+    "bitmap marks block in use but it is not in use.",
+    "direct address used more than once.",
+    "indirect address used more than once.",
+    "inode marked use but not found in a directory.",
+    "inode referred to in directory but marked free.",
+    "bad reference count for file.",
+    "directory appears more than once in file system.",
+    "bad reference count for directory."
+};
+
+typedef struct _block_usage {
+    uint uses;        // references from in-use inodes, indirect blocks included
+    uint direct;      // references from direct addresses (Point 7)
+    uint indirect;    // references from indirect block entries (Point 8)
+    uint owner;       // the inode that referenced it last
+    uint rules;       // bitmask of the rules the block violates
+} block_usage;
+
+typedef struct _inode_state {
+    struct dinode snapshot;  // the inode as last accounted
+    uint *entries;           // its indirect block as last accounted
+    char *local_error;       // Points 1 to 4, NULL if they pass
+    int references;          // directory entries naming the inode
+    int subdirectories;      // entries of this directory naming directories
+    uint rules;
+} inode_state;
+
+typedef struct _incremental_state {
+    img_pointers *image;
+    char *bitmap;
+    block_usage *blocks;     // indexed from the start of the data region
+    inode_state *inodes;
+    uint violations[RULE_COUNT];
+    uint stray_entries;      // entries naming inodes past the table, counted under Point 10
+    uint local_errors;
+    bool namespace_dirty;    // a directory changed type; recount all entries
+    bool topology_dirty;     // a directory was linked or unlinked
+    bool unreachable;        // some directory cannot be reached from the root
+    const char *fatal;       // set while the superblock is invalid
+    bool recording;          // writes are logged so they can be rolled back
+    uint undo_count;
+    uint undo_capacity;
+    struct _undo_record *undo;
+} incremental_state;
+
+// The previous contents of a block, for rolling a write back.
+typedef struct _undo_record {
+    uint block;
+    char data[BLOCK_SIZE];
+} undo_record;
+
+struct dinode *incremental_inode(incremental_state *state, uint inum) {
+    return (struct dinode *)block_addr(state->image, 2) + inum;
+}
+
+// Returns the usage of a data block, or NULL outside the data region.
+block_usage *incremental_block(incremental_state *state, uint address) {
+    uint start = state->image->geo.data_start;
+    if (address < start || address - start >= state->image->sb->nblocks) return NULL;
+    return &state->blocks[address - start];
+}
+
+// Replaces a rule bitmask and keeps the per-rule violation counts in step.
+void incremental_set_rules(incremental_state *state, uint *current, uint rules) {
+    uint changed = *current ^ rules;
+    for (int rule = 0; changed != 0; rule++, changed >>= 1) {
+        if (changed & 1) {
+            if (rules & (1u << rule)) {
+                state->violations[rule]++;
+            } else {
+                state->violations[rule]--;
+            }
+        }
+    }
+    *current = rules;
+}
+
+// Points 5 to 8 for one block.
+void incremental_refresh_block(incremental_state *state, uint address) {
+    block_usage *usage = incremental_block(state, address);
+    if (usage == NULL) return;
+
+    bool allocated = is_bit_set(state->bitmap, address);
+    uint rules = 0;
+    if (usage->uses > 0 && !allocated) rules |= 1u << RULE_BITMAP_FREE;
+    if (usage->uses == 0 && allocated) rules |= 1u << RULE_BITMAP_UNUSED;
+    if (usage->direct > 1) rules |= 1u << RULE_DIRECT_TWICE;
+    if (usage->indirect > 1) rules |= 1u << RULE_INDIRECT_TWICE;
+    incremental_set_rules(state, &usage->rules, rules);
+}
+
+// Points 9 to 12 and the directory link count for one inode.
+void incremental_refresh_inode(incremental_state *state, uint inum) {
+    inode_state *node = &state->inodes[inum];
+    struct dinode *inode = incremental_inode(state, inum);
+    uint rules = 0;
+
+    if (inum > ROOTINO) {
+        if (inode->type != 0 && node->references == 0) rules |= 1u << RULE_UNREFERENCED;
+        if (inode->type == 0 && node->references > 0) rules |= 1u << RULE_REFERENCED_FREE;
+        if (inode->type == INODE_FILE && inode->nlink != node->references) rules |= 1u << RULE_FILE_NLINK;
+        if (inode->type == INODE_DIR && node->references > 1) rules |= 1u << RULE_DIRECTORY_TWICE;
+    }
+    // No entry but the root's own "." and ".." may name the root
+    if (inum == ROOTINO && node->references > 0) rules |= 1u << RULE_DIRECTORY_TWICE;
+    if (inum >= ROOTINO && inode->type == INODE_DIR && inode->nlink != 1 + node->subdirectories) {
+        rules |= 1u << RULE_DIRECTORY_NLINK;
+    }
+    incremental_set_rules(state, &node->rules, rules);
+}
+
+// Points 1 to 4 for one inode, run under the error trap.
+void incremental_check_local(incremental_state *state, uint inum) {
+    inode_state *node = &state->inodes[inum];
+    struct dinode *inode = incremental_inode(state, inum);
+    jmp_buf trap, *saved_trap = error_trap;
+
+    if (node->local_error != NULL) {
+        free(node->local_error);
+        node->local_error = NULL;
+        state->local_errors--;
+    }
+    if (inode->type == 0) return;
+
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        validate_inode_type(inode);
+        validate_block_addresses(state->image->sb, inode, state->image);
+        if (inum == ROOTINO && inode->type != INODE_DIR) {
+            exit_with_error("root directory does not exist.");
+        }
+        if (inode->type == INODE_DIR) {
+            validate_directory_structure(inode, state->image, inum);
+        }
+    } else {
+        node->local_error = xstrdup(MEM_INCREMENTAL, trapped_error);
+        state->local_errors++;
+    }
+    error_trap = saved_trap;
+}
+
+// Adds (sign 1) or withdraws (sign -1) the entries of one directory block.
+void incremental_tally_entries(incremental_state *state, uint dir, const char *block, int sign) {
+    struct dirent *entry = (struct dirent *)block;
+
+    for (uint idx = 0; idx < BSIZE / sizeof(struct dirent); idx++, entry++) {
+        if (entry->inum == 0) continue;
+        if (strncmp(entry->name, ".", DIRSIZ) == 0 || strncmp(entry->name, "..", DIRSIZ) == 0) continue;
+        // There is no inode to hold these, so the state keeps their count;
+        // the full check reports them as referring to a free inode
+        if (entry->inum >= state->image->sb->ninodes) {
+            state->stray_entries += sign;
+            state->violations[RULE_REFERENCED_FREE] += sign;
+            continue;
+        }
+
+        inode_state *child = &state->inodes[entry->inum];
+        child->references += sign;
+        if (child->snapshot.type == INODE_DIR && entry->inum != ROOTINO) {
+            state->inodes[dir].subdirectories += sign;
+            state->topology_dirty = true;
+            incremental_refresh_inode(state, dir);
+        }
+        incremental_refresh_inode(state, entry->inum);
+    }
+}
+
+enum reference_kind { REFERENCE_DIRECT, REFERENCE_INDIRECT_BLOCK, REFERENCE_ENTRY };
+
+void incremental_account_block(incremental_state *state, uint inum, uint address, int sign, enum reference_kind kind) {
+    block_usage *usage = incremental_block(state, address);
+    if (usage == NULL) return;
+
+    // A directory's entries are counted while its block map references them
+    bool directory = state->inodes[inum].snapshot.type == INODE_DIR && kind != REFERENCE_INDIRECT_BLOCK;
+    if (directory && sign < 0) incremental_tally_entries(state, inum, block_addr(state->image, address), -1);
+
+    usage->uses += sign;
+    if (kind == REFERENCE_DIRECT) usage->direct += sign;
+    if (kind == REFERENCE_ENTRY) usage->indirect += sign;
+    if (sign > 0) usage->owner = inum;
+
+    if (directory && sign > 0) incremental_tally_entries(state, inum, block_addr(state->image, address), 1);
+    incremental_refresh_block(state, address);
+}
+
+// Adds or withdraws every block reference of an inode's snapshot.
+void incremental_account_inode(incremental_state *state, uint inum, int sign) {
+    inode_state *node = &state->inodes[inum];
+    if (node->snapshot.type == 0) return;
+
+    for (int idx = 0; idx < NDIRECT; idx++) {
+        incremental_account_block(state, inum, node->snapshot.addrs[idx], sign, REFERENCE_DIRECT);
+    }
+    if (node->snapshot.addrs[NDIRECT] == 0) return;
+    incremental_account_block(state, inum, node->snapshot.addrs[NDIRECT], sign, REFERENCE_INDIRECT_BLOCK);
+    if (node->entries == NULL) return;
+    for (int idx = 0; idx < NINDIRECT; idx++) {
+        incremental_account_block(state, inum, node->entries[idx], sign, REFERENCE_ENTRY);
+    }
+}
+
+// Takes a snapshot of the inode and, if it lies inside the image, its
+// indirect block.
+void incremental_snapshot(incremental_state *state, uint inum) {
+    inode_state *node = &state->inodes[inum];
+    struct dinode *inode = incremental_inode(state, inum);
+    uint indirect = inode->addrs[NDIRECT];
+
+    node->snapshot = *inode;
+    if (inode->type != 0 && indirect != 0 && indirect < state->image->sb->size) {
+        if (node->entries == NULL) node->entries = xcalloc(MEM_INCREMENTAL, NINDIRECT, sizeof(uint));
+        memcpy(node->entries, block_addr(state->image, indirect), NINDIRECT * sizeof(uint));
+    } else if (node->entries != NULL) {
+        free(node->entries);
+        node->entries = NULL;
+    }
+}
+
+// Re-accounts an inode after its dinode or its indirect block changed.
+void incremental_update_inode(incremental_state *state, uint inum) {
+    bool was_directory = state->inodes[inum].snapshot.type == INODE_DIR;
+
+    incremental_account_inode(state, inum, -1);
+    incremental_snapshot(state, inum);
+    incremental_account_inode(state, inum, 1);
+    // The subdirectory counts of its parents depend on its type
+    if (was_directory != (state->inodes[inum].snapshot.type == INODE_DIR)) state->namespace_dirty = true;
+
+    incremental_check_local(state, inum);
+    incremental_refresh_inode(state, inum);
+}
+
+// True if the snapshot of inum references address.
+bool incremental_references(incremental_state *state, uint inum, uint address) {
+    inode_state *node = &state->inodes[inum];
+    if (node->snapshot.type == 0) return false;
+    for (int idx = 0; idx <= NDIRECT; idx++) {
+        if (node->snapshot.addrs[idx] == address) return true;
+    }
+    for (int idx = 0; node->entries != NULL && idx < NINDIRECT; idx++) {
+        if (node->entries[idx] == address) return true;
+    }
+    return false;
+}
+
+// Applies a data block write to an inode referencing the block. old holds
+// the previous contents.
+void incremental_owner_written(incremental_state *state, uint inum, uint address, const char *old) {
+    inode_state *node = &state->inodes[inum];
+
+    if (node->snapshot.addrs[NDIRECT] == address) {
+        incremental_update_inode(state, inum);
+    } else if (node->snapshot.type == INODE_DIR) {
+        incremental_tally_entries(state, inum, old, -1);
+        incremental_tally_entries(state, inum, block_addr(state->image, address), 1);
+        incremental_check_local(state, inum);
+    }
+}
+
+// Lists the blocks holding a directory's entries.
+uint incremental_directory_blocks(incremental_state *state, uint inum, uint *blocks) {
+    inode_state *node = &state->inodes[inum];
+    uint count = 0;
+
+    for (int idx = 0; idx < NDIRECT; idx++) {
+        if (incremental_block(state, node->snapshot.addrs[idx]) != NULL) blocks[count++] = node->snapshot.addrs[idx];
+    }
+    for (int idx = 0; node->entries != NULL && idx < NINDIRECT; idx++) {
+        if (incremental_block(state, node->entries[idx]) != NULL) blocks[count++] = node->entries[idx];
+    }
+    return count;
+}
+
+// Recounts every directory entry, after a directory changed type.
+void incremental_recount_namespace(incremental_state *state) {
+    uint ninodes = state->image->sb->ninodes;
+    uint blocks[MAXFILE];
+
+    for (uint inum = 0; inum < ninodes; inum++) {
+        state->inodes[inum].references = 0;
+        state->inodes[inum].subdirectories = 0;
+    }
+    state->violations[RULE_REFERENCED_FREE] -= state->stray_entries;
+    state->stray_entries = 0;
+    for (uint inum = 0; inum < ninodes; inum++) {
+        if (state->inodes[inum].snapshot.type != INODE_DIR) continue;
+        uint count = incremental_directory_blocks(state, inum, blocks);
+        for (uint idx = 0; idx < count; idx++) {
+            incremental_tally_entries(state, inum, block_addr(state->image, blocks[idx]), 1);
+        }
+    }
+    for (uint inum = 0; inum < ninodes; inum++) {
+        incremental_refresh_inode(state, inum);
+    }
+    state->namespace_dirty = false;
+    state->topology_dirty = true;
+}
+
+// True if every directory in use can be reached from the root, which the
+// full check's traversal requires.
+bool incremental_all_reachable(incremental_state *state) {
+    uint ninodes = state->image->sb->ninodes;
+    bool *seen = xcalloc(MEM_INCREMENTAL, ninodes, sizeof(bool));
+    uint *stack = xcalloc(MEM_INCREMENTAL, ninodes, sizeof(uint));
+    uint blocks[MAXFILE];
+    uint top = 0;
+    bool reachable = true;
+
+    seen[ROOTINO] = true;
+    stack[top++] = ROOTINO;
+    while (top > 0) {
+        uint dir = stack[--top];
+        uint count = incremental_directory_blocks(state, dir, blocks);
+        for (uint idx = 0; idx < count; idx++) {
+            struct dirent *entry = (struct dirent *)block_addr(state->image, blocks[idx]);
+            for (uint slot = 0; slot < BSIZE / sizeof(struct dirent); slot++, entry++) {
+                if (entry->inum == 0 || entry->inum >= ninodes || seen[entry->inum]) continue;
+                if (state->inodes[entry->inum].snapshot.type != INODE_DIR) continue;
+                seen[entry->inum] = true;
+                stack[top++] = entry->inum;
+            }
+        }
+    }
+    for (uint inum = ROOTINO; inum < ninodes; inum++) {
+        if (state->inodes[inum].snapshot.type == INODE_DIR && !seen[inum]) reachable = false;
+    }
+
+    free(seen);
+    free(stack);
+    return reachable;
+}
+
+void incremental_release(incremental_state *state) {
+    if (state->inodes != NULL) {
+        for (uint inum = 0; inum < state->image->sb->ninodes; inum++) {
+            free(state->inodes[inum].entries);
+            free(state->inodes[inum].local_error);
+        }
+    }
+    free(state->inodes);
+    free(state->blocks);
+    state->inodes = NULL;
+    state->blocks = NULL;
+}
+
+// Builds the whole state from the image, as a full check would.
+void incremental_build(incremental_state *state) {
+    img_pointers *image = state->image;
+    struct superblock *sb = image->sb;
+
+    compute_geometry(&image->geo, sb);
+    state->bitmap = block_addr(image, 2 + image->geo.ninodeblocks);
+    state->blocks = xcalloc(MEM_INCREMENTAL, sb->nblocks, sizeof(block_usage));
+    state->inodes = xcalloc(MEM_INCREMENTAL, sb->ninodes, sizeof(inode_state));
+    memset(state->violations, 0, sizeof(state->violations));
+    state->stray_entries = 0;
+    state->local_errors = 0;
+    state->fatal = NULL;
+
+    for (uint inum = 0; inum < sb->ninodes; inum++) {
+        incremental_snapshot(state, inum);
+        incremental_account_inode(state, inum, 1);
+        incremental_check_local(state, inum);
+    }
+    for (uint block = 0; block < sb->nblocks; block++) {
+        incremental_refresh_block(state, image->geo.data_start + block);
+    }
+    incremental_recount_namespace(state);
+}
+
+// Prepares incremental verification of a loaded image. Writes go to a
+// private copy of the mapping; the image file is never modified.
+void incremental_open(incremental_state *state, img_pointers *image) {
+    memset(state, 0, sizeof(*state));
+    state->image = image;
+    if (mprotect(image->mapping, image->map_length, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect failed");
+        exit(1);
+    }
+    incremental_build(state);
+}
+
+void incremental_close(incremental_state *state) {
+    incremental_release(state);
+    free(state->undo);
+}
+
+// Applies one block write. Returns false if the block lies outside the
+// mapped image.
+bool incremental_write(incremental_state *state, uint block, const char *data) {
+    img_pointers *image = state->image;
+    char old[BLOCK_SIZE];
+
+    if (((uint64_t)block << image->geo.block_shift) >= image->map_length - (image->mmapimage - image->mapping)) return false;
+    char *target = block_addr(image, block);
+    if (memcmp(target, data, BLOCK_SIZE) == 0) return true;
+    memcpy(old, target, BLOCK_SIZE);
+    memcpy(target, data, BLOCK_SIZE);
+
+    if (state->recording) {
+        if (state->undo_count == state->undo_capacity) {
+            mem_account(MEM_INCREMENTAL, (state->undo_capacity ? state->undo_capacity : 16) * sizeof(undo_record));
+            state->undo_capacity = state->undo_capacity ? state->undo_capacity * 2 : 16;
+            state->undo = realloc(state->undo, state->undo_capacity * sizeof(undo_record));
+        }
+        state->undo[state->undo_count].block = block;
+        memcpy(state->undo[state->undo_count++].data, old, BLOCK_SIZE);
+    }
+
+    // A new superblock changes the geometry, so everything is rebuilt
+    if (block == 1 || state->fatal != NULL) {
+        if (block != 1) return true;
+        jmp_buf trap, *saved_trap = error_trap;
+        incremental_release(state);
+        error_trap = &trap;
+        if (setjmp(trap) == 0) {
+            validate_superblock(image->sb, image->map_length - (image->mmapimage - image->mapping));
+            incremental_build(state);
+        } else {
+            state->fatal = "bad superblock.";
+        }
+        error_trap = saved_trap;
+        return true;
+    }
 
-    while (stackTop > 0) {
-        struct dinode *current = stack[--stackTop];
+    switch (classify_block(&image->geo, block)) {
+    case REGION_INODE:
+        for (uint idx = 0; idx < IPB; idx++) {
+            uint inum = (block - 2) * IPB + idx;
+            if (inum < image->sb->ninodes && memcmp(old + idx * sizeof(struct dinode), target + idx * sizeof(struct dinode), sizeof(struct dinode)) != 0) {
+                incremental_update_inode(state, inum);
+            }
+        }
+        break;
+    case REGION_BITMAP:
+        for (uint byte = 0; byte < BLOCK_SIZE; byte++) {
+            for (uint bit = 0; old[byte] != target[byte] && bit < 8; bit++) {
+                if ((old[byte] ^ target[byte]) & (1 << bit)) {
+                    incremental_refresh_block(state, (block - 2 - image->geo.ninodeblocks) * BPB + byte * 8 + bit);
+                }
+            }
+        }
+        break;
+    case REGION_DATA: {
+        // Contents of free blocks and file data are not checked
+        block_usage *usage = incremental_block(state, block);
+        if (usage->uses == 1 && incremental_references(state, usage->owner, block)) {
+            incremental_owner_written(state, usage->owner, block, old);
+        } else if (usage->uses > 0) {
+            for (uint inum = 0; inum < image->sb->ninodes; inum++) {
+                if (incremental_references(state, inum, block)) incremental_owner_written(state, inum, block, old);
+            }
+        }
+        break;
+    }
+    default:
+        // The boot block and the log are not checked
+        break;
+    }
+    return true;
+}
 
-        // Skip if not a directory
-        if (current->type != INODE_DIR) {
-            continue;
+// Starts logging writes so that incremental_rollback can undo them.
+void incremental_checkpoint(incremental_state *state) {
+    state->recording = true;
+    state->undo_count = 0;
+}
+
+// Undoes every write since the checkpoint, newest first, through the same
+// incremental updates.
+void incremental_rollback(incremental_state *state) {
+    state->recording = false;
+    while (state->undo_count > 0) {
+        undo_record *record = &state->undo[--state->undo_count];
+        incremental_write(state, record->block, record->data);
+    }
+}
+
+// Returns the error the full check would report for the image as written
+// so far, or NULL if it is consistent.
+// True if the inode in use refers to a block the bitmap marks free, which
+// the inode scan reports right after the inode's own checks (Point 5).
+bool incremental_uses_free_block(incremental_state *state, uint inum) {
+    inode_state *node = &state->inodes[inum];
+    if (node->snapshot.type == 0) return false;
+
+    for (int idx = 0; idx <= NDIRECT; idx++) {
+        block_usage *usage = incremental_block(state, node->snapshot.addrs[idx]);
+        if (usage != NULL && usage->rules & (1u << RULE_BITMAP_FREE)) return true;
+    }
+    for (int idx = 0; node->entries != NULL && idx < NINDIRECT; idx++) {
+        block_usage *usage = incremental_block(state, node->entries[idx]);
+        if (usage != NULL && usage->rules & (1u << RULE_BITMAP_FREE)) return true;
+    }
+    return false;
+}
+
+// Returns the error a full check of the image would report first, or NULL.
+// The counts say whether an error exists; picking the same one as the full
+// check follows its order: the inode scan (Points 1 to 4, then Point 5, per
+// inode), the bitmap (Point 6), the lowest block used twice (Points 7 and
+// 8, direct first), then the directory traversal. The traversal is run as
+// in the full check, since which entry it meets first depends on the whole
+// namespace. Only the violated phase is scanned, so a consistent image
+// costs no more than the counts.
+const char *incremental_verdict(incremental_state *state) {
+    if (state->fatal != NULL) return state->fatal;
+    if (state->namespace_dirty) incremental_recount_namespace(state);
+    if (state->topology_dirty) {
+        state->unreachable = !incremental_all_reachable(state);
+        state->topology_dirty = false;
+    }
+
+    if (state->local_errors > 0 || state->violations[RULE_BITMAP_FREE] > 0) {
+        for (uint inum = 0; inum < state->image->sb->ninodes; inum++) {
+            if (state->inodes[inum].local_error != NULL) return state->inodes[inum].local_error;
+            if (state->violations[RULE_BITMAP_FREE] > 0 && incremental_uses_free_block(state, inum)) {
+                return incremental_rule_messages[RULE_BITMAP_FREE];
+            }
+        }
+    }
+    if (state->violations[RULE_BITMAP_UNUSED] > 0) return incremental_rule_messages[RULE_BITMAP_UNUSED];
+    if (state->violations[RULE_DIRECT_TWICE] > 0 || state->violations[RULE_INDIRECT_TWICE] > 0) {
+        for (uint idx = 0; idx < state->image->sb->nblocks; idx++) {
+            if (state->blocks[idx].rules & (1u << RULE_DIRECT_TWICE)) return incremental_rule_messages[RULE_DIRECT_TWICE];
+            if (state->blocks[idx].rules & (1u << RULE_INDIRECT_TWICE)) return incremental_rule_messages[RULE_INDIRECT_TWICE];
         }
+    }
 
-        // Traverse direct addresses
-        for (int i = 0; i < NDIRECT; i++) {
-            uint blockaddr = current->addrs[i];
-            if (blockaddr == 0) continue;
+    bool directory_errors = state->unreachable;
+    for (int rule = RULE_UNREFERENCED; rule < RULE_COUNT; rule++) {
+        if (state->violations[rule] > 0) directory_errors = true;
+    }
+    if (!directory_errors) return NULL;
 
-            struct dirent *dir = (struct dirent *)(image->mmapimage + blockaddr * BLOCK_SIZE);
-            int entries_per_block = BSIZE / sizeof(struct dirent);
+    jmp_buf trap, *saved_trap = error_trap;
+    const char *error = NULL;
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        validate_directory_rules(block_addr(state->image, 2), state->image, state->image->sb);
+    } else {
+        for (int rule = RULE_UNREFERENCED; rule < RULE_COUNT; rule++) {
+            if (strcmp(trapped_error, incremental_rule_messages[rule]) == 0) error = incremental_rule_messages[rule];
+        }
+    }
+    error_trap = saved_trap;
+    check_release();
+    current_site = (error_site){ 0, 0 };
+    if (error != NULL) return error;
 
-            for (int j = 0; j < entries_per_block; j++, dir++) {
-                if (dir->inum != 0 && strcmp(dir->name, ".") != 0 && strcmp(dir->name, "..") != 0) {
-                    inodemap[dir->inum]++;
-                    struct dinode *next = ((struct dinode *)(inodeblocks)) + dir->inum;
-                    if (stackTop == stackSize) {
-                        // Resize the stack if needed
-                        stackSize *= 2;
-                        stack = realloc(stack, stackSize * sizeof(struct dinode *));
-                    }
-                    stack[stackTop++] = next;
-                }
+    // Not expected: the counts and the traversal disagree
+    for (int rule = RULE_UNREFERENCED; rule < RULE_COUNT; rule++) {
+        if (state->violations[rule] > 0) return incremental_rule_messages[rule];
+    }
+    return incremental_rule_messages[RULE_UNREFERENCED];
+}
+
+// Replays a trace of block writes (a little-endian uint32 block number
+// followed by the BSIZE new bytes, per write) against a checked image and
+// reports the first write after which it is inconsistent.
+void replay_trace(img_pointers *image, const char *path) {
+    incremental_state state;
+    uint32_t block;
+    char data[BLOCK_SIZE];
+
+    FILE *trace = fopen(path, "rb");
+    if (trace == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    incremental_open(&state, image);
+    for (uint64_t write = 1; fread(&block, sizeof(block), 1, trace) == 1; write++) {
+        if (fread(data, BLOCK_SIZE, 1, trace) != 1) {
+            fprintf(stderr, "ERROR: write %llu is truncated.\n", (unsigned long long)write);
+            exit(1);
+        }
+        if (!incremental_write(&state, block, data)) {
+            fprintf(stderr, "ERROR: write %llu (block %u) is outside the image.\n", (unsigned long long)write, block);
+            exit(1);
+        }
+        const char *error = incremental_verdict(&state);
+        if (error != NULL) {
+            fprintf(stderr, "ERROR: write %llu (block %u): %s\n", (unsigned long long)write, block, error);
+            exit(1);
+        }
+    }
+    fclose(trace);
+    incremental_close(&state);
+}
+
+// Checks each delta file (records as in a replay trace) as an overlay of
+// the checked base image. The state of the base is built once; each delta
+// is applied, judged, and rolled back before the next one.
+bool check_deltas(img_pointers *image, const char **deltas, uint ndeltas) {
+    incremental_state state;
+    uint32_t block;
+    char data[BLOCK_SIZE];
+    char message[256];
+    bool failed = false;
+
+    incremental_open(&state, image);
+    for (uint idx = 0; idx < ndeltas; idx++) {
+        FILE *delta = fopen(deltas[idx], "rb");
+        if (delta == NULL) {
+            perror(deltas[idx]);
+            exit(1);
+        }
+
+        const char *error = NULL;
+        uint64_t span = trace_begin();
+        incremental_checkpoint(&state);
+        while (error == NULL && fread(&block, sizeof(block), 1, delta) == 1) {
+            if (fread(data, BLOCK_SIZE, 1, delta) != 1) {
+                error = "delta is truncated.";
+            } else if (!incremental_write(&state, block, data)) {
+                error = "delta writes outside the image.";
             }
         }
+        fclose(delta);
+        if (error == NULL) error = incremental_verdict(&state);
+        // The verdict may point into state that the rollback frees
+        if (error != NULL) {
+            snprintf(message, sizeof(message), "%s", error);
+            error = message;
+        }
+        incremental_rollback(&state);
+        trace_span("delta", deltas[idx], span, 0, state.undo_capacity);
 
-        // Traverse indirect address
-        uint blockaddr = current->addrs[NDIRECT];
+        if (error != NULL) {
+            printf("%s: ERROR: %s\n", deltas[idx], error);
+            failed = true;
+        } else {
+            printf("%s: ok\n", deltas[idx]);
+        }
+    }
+    incremental_close(&state);
+    return !failed;
+}
 
-        if (blockaddr != 0) {
-            uint *indirect = (uint *)(image->mmapimage + blockaddr * BLOCK_SIZE);
-            for (int i = 0; i < NINDIRECT; i++, indirect++) {
-                blockaddr = *indirect;
-                if (blockaddr == 0) continue;
+img_pointers *mem_report_image = NULL;
 
-                struct dirent *dir = (struct dirent *)(image->mmapimage + blockaddr * BLOCK_SIZE);
-                int entries_per_block = BSIZE / sizeof(struct dirent);
-                for (int j = 0; j < entries_per_block; j++, dir++) {
-                    if (dir->inum != 0 && strcmp(dir->name, ".") != 0 && strcmp(dir->name, "..") != 0) {
-                        inodemap[dir->inum]++;
-                        struct dinode *next = ((struct dinode *)(inodeblocks)) + dir->inum;
-                        if (stackTop == stackSize) {
-                            // Resize the stack if needed
-                            stackSize *= 2;
-                            stack = realloc(stack, stackSize * sizeof(struct dinode *));
-                        }
-                        stack[stackTop++] = next;
-                    }
-                }
+// Prints bytes allocated per structure, how much of the image mapping is
+// resident, the page faults taken and the peak RSS. Runs on exit.
+void mem_report(void) {
+    struct rusage usage;
+    uint64_t total = 0;
+
+    fprintf(stderr, "memory report:\n");
+    for (int category = 0; category < MEM_CATEGORIES; category++) {
+        uint64_t bytes = __atomic_load_n(&mem_allocated[category], __ATOMIC_RELAXED);
+        total += bytes;
+        fprintf(stderr, "  %-24s %12llu bytes\n", mem_category_names[category], (unsigned long long)bytes);
+    }
+    fprintf(stderr, "  %-24s %12llu bytes\n", "total allocated", (unsigned long long)total);
+
+    if (mem_report_image != NULL && mem_report_image->mapping != NULL) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        uint64_t npages = (mem_report_image->map_length + page_size - 1) / page_size;
+        unsigned char *resident = malloc(npages);
+        uint64_t nresident = 0;
+        if (resident != NULL && mincore(mem_report_image->mapping, mem_report_image->map_length, resident) == 0) {
+            for (uint64_t page = 0; page < npages; page++) {
+                nresident += resident[page] & 1;
             }
         }
+        free(resident);
+        fprintf(stderr, "  %-24s %12llu bytes mapped, %llu bytes resident\n", "image mapping",
+                (unsigned long long)mem_report_image->map_length, (unsigned long long)(nresident * page_size));
     }
 
-    free(stack);
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(stderr, "  %-24s %12ld minor, %ld major\n", "page faults", usage.ru_minflt, usage.ru_majflt);
+        fprintf(stderr, "  %-24s %12ld KB\n", "peak RSS", usage.ru_maxrss);
+    }
 }
 
-// Point 9, 10, 11, 12
-// Validates directory-related points across all in-use inodes.
-void validate_directory_rules(char *inode_blocks, img_pointers *img, struct superblock *fs_sb) {
-    int inode_references[fs_sb->ninodes];
-    memset(inode_references, 0, sizeof(int) * fs_sb->ninodes);
-    struct dinode *curr_inode;
-    struct dinode *root_inode;
-    curr_inode = (struct dinode *)inode_blocks;
-    root_inode=++curr_inode;
-    
-    // Increment reference count for reserved inodes
-    inode_references[0]++;
-    inode_references[1]++;
+// Validates the superblock of the file system at byte base of the open
+// image with a single pread before anything is mapped, so garbage
+// superblocks are rejected cheaply. Only the span the superblock describes
+// is then mapped.
+void map_image(img_pointers *image, uint64_t base, uint64_t length) {
+    struct superblock sb;
 
-    // Analyzing directory entries to count inode references
-    scan_directory_entries(inode_blocks, img, root_inode, inode_references); // Skips the first inode (root)
-    
-    // Verifying directory points for each inode
-    curr_inode++;
-    for (int inode_idx = 2; inode_idx < fs_sb->ninodes; inode_idx++, curr_inode++) {
-        if (curr_inode->type != 0 && inode_references[inode_idx] == 0) {
-            exit_with_error("inode marked use but not found in a directory.");
+    if (pread(image->fd, &sb, sizeof(sb), base + BLOCK_SIZE) != sizeof(sb)) {
+        exit_with_error("bad superblock.");
+    }
+    validate_superblock(&sb, length);
+    compute_geometry(&image->geo, &sb);
+
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t slack = base % page_size;
+    image->base = base;
+    image->map_length = slack + ((uint64_t)sb.size << image->geo.block_shift);
+    image->mapping = mmap(NULL, image->map_length, PROT_READ, MAP_PRIVATE, image->fd, base - slack);
+    if (image->mapping == MAP_FAILED) {
+        perror("mmap failed");
+        exit(1);
+    }
+    image->mmapimage = image->mapping + slack;
+    image->read_blocks = throttle.active ? xcalloc(MEM_THROTTLE, ((uint64_t)sb.size + 63) / 64, sizeof(uint64_t)) : NULL;
+
+    image->sb = (struct superblock *)block_addr(image, 1);
+}
+
+// Opens an image that holds one file system and maps it.
+void load_image(const char *path, img_pointers *image) {
+    struct stat fileStat;
+
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0) {
+        fprintf(stderr, "image not found\n");
+        exit(1);
+    }
+
+    if (fstat(image->fd, &fileStat) < 0) {
+        exit(1);
+    }
+
+    map_image(image, 0, fileStat.st_size);
+}
+
+// Partition tables. Disk images may hold several file systems behind an MBR
+// or a GPT; each partition is checked as an image of its own, located by its
+// byte range in the file. Sectors are 512 bytes.
+#define SECTOR_SIZE 512
+#define MAX_PARTITIONS 128
+
+typedef struct _partition {
+    uint64_t offset;
+    uint64_t length;
+} partition;
+
+// True if a file system superblock sits at block 1 of [base, base + length).
+bool has_superblock(int fd, uint64_t base, uint64_t length) {
+    struct superblock sb;
+    jmp_buf trap;
+    bool valid = false;
+
+    if (pread(fd, &sb, sizeof(sb), base + BLOCK_SIZE) != sizeof(sb)) return false;
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        validate_superblock(&sb, length);
+        valid = true;
+    }
+    error_trap = NULL;
+    return valid;
+}
+
+void add_partition(partition *parts, uint *count, uint64_t first_sector, uint64_t nsectors, uint64_t file_size) {
+    uint64_t offset = first_sector * SECTOR_SIZE;
+    if (*count == MAX_PARTITIONS || nsectors == 0 || offset >= file_size) return;
+    uint64_t length = nsectors * SECTOR_SIZE;
+    if (length > file_size - offset) length = file_size - offset;
+    parts[(*count)++] = (partition){ offset, length };
+}
+
+#define GPT_ENTRY_SIZE 128    // size of the GPT partition entry structure
+#define GPT_MAX_ENTRIES 128   // the 16 KB entry array the UEFI spec reserves
+
+// Reads the GPT header at sector 1 and adds every used entry. The entry
+// count and size come from the disk, so the entries read are limited to
+// GPT_MAX_ENTRIES and to the sectors between the entry array and the first
+// usable sector; an entry size below the structure's is rejected.
+void read_gpt(int fd, partition *parts, uint *count, uint64_t file_size) {
+    unsigned char header[92];
+    if (pread(fd, header, sizeof(header), SECTOR_SIZE) != sizeof(header) || memcmp(header, "EFI PART", 8) != 0) return;
+
+    uint64_t first_usable, table;
+    uint nentries, entry_size;
+    memcpy(&first_usable, header + 40, 8);
+    memcpy(&table, header + 72, 8);
+    memcpy(&nentries, header + 80, 4);
+    memcpy(&entry_size, header + 84, 4);
+    if (entry_size < GPT_ENTRY_SIZE || table < 2 || table >= file_size / SECTOR_SIZE) return;
+
+    if (nentries > GPT_MAX_ENTRIES) nentries = GPT_MAX_ENTRIES;
+    if (first_usable > table && (first_usable - table) * SECTOR_SIZE / entry_size < nentries) {
+        nentries = (first_usable - table) * SECTOR_SIZE / entry_size;
+    }
+
+    for (uint idx = 0; idx < nentries && *count < MAX_PARTITIONS; idx++) {
+        unsigned char entry[48];
+        static const unsigned char unused[16];
+        if (pread(fd, entry, sizeof(entry), table * SECTOR_SIZE + (uint64_t)idx * entry_size) != sizeof(entry)) return;
+        if (memcmp(entry, unused, sizeof(unused)) == 0) continue;
+
+        uint64_t first, last;
+        memcpy(&first, entry + 32, 8);
+        memcpy(&last, entry + 40, 8);
+        if (last >= first) add_partition(parts, count, first, last - first + 1, file_size);
+    }
+}
+
+// Finds the partitions of an image whose block 1 is not a superblock.
+// Returns 0 for an unpartitioned image. Extended MBR partitions are not
+// followed.
+uint find_partitions(int fd, uint64_t file_size, partition *parts) {
+    unsigned char mbr[SECTOR_SIZE];
+    uint count = 0;
+
+    if (has_superblock(fd, 0, file_size)) return 0;
+    if (pread(fd, mbr, sizeof(mbr), 0) != sizeof(mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA) return 0;
+
+    for (int slot = 0; slot < 4; slot++) {
+        unsigned char *entry = mbr + 446 + 16 * slot;
+        uint first, nsectors;
+        memcpy(&first, entry + 8, 4);
+        memcpy(&nsectors, entry + 12, 4);
+        if (entry[4] == 0xEE) {
+            read_gpt(fd, parts, &count, file_size);
+            return count;
         }
-        if (inode_references[inode_idx] > 0 && curr_inode->type == 0 ) {
-            exit_with_error("inode referred to in directory but marked free.");
+        if (entry[4] != 0 && entry[4] != 0x05 && entry[4] != 0x0F && entry[4] != 0x85) {
+            add_partition(parts, &count, first, nsectors, file_size);
         }
-        if (curr_inode->type == INODE_FILE && curr_inode->nlink != inode_references[inode_idx]) {
-            exit_with_error("bad reference count for file.");
+    }
+    return count;
+}
+
+// Opens an image and maps the file system it holds. If it holds a partition
+// table instead, one child process per partition maps that partition and
+// returns its number (from 1) to run the checks, while the parent waits for
+// all of them, prints their output as one report and exits with 1 if any
+// failed. Returns 0 for an unpartitioned image. Modes that need a single
+// file system pass single_only to reject partitioned images.
+uint load_partitioned_image(const char *path, img_pointers *image, bool single_only) {
+    struct stat fileStat;
+    partition parts[MAX_PARTITIONS];
+
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0) {
+        fprintf(stderr, "image not found\n");
+        exit(1);
+    }
+    if (fstat(image->fd, &fileStat) < 0) {
+        exit(1);
+    }
+
+    uint count = find_partitions(image->fd, fileStat.st_size, parts);
+    if (count == 0) {
+        map_image(image, 0, fileStat.st_size);
+        return 0;
+    }
+    if (single_only) {
+        exit_with_error("--shell, --extract, --replay and --delta need an unpartitioned image.");
+    }
+
+    // Workers and I/O budget are split between the partitions
+    uint share = worker_count() / count;
+    FILE *output[MAX_PARTITIONS];
+    pid_t children[MAX_PARTITIONS];
+    uint64_t span = trace_begin();
+    fflush(stdout);
+    fflush(stderr);
+    for (uint idx = 0; idx < count; idx++) {
+        output[idx] = tmpfile();
+        if (output[idx] == NULL) {
+            perror("tmpfile");
+            exit(1);
         }
-        if (curr_inode->type == INODE_DIR && inode_references[inode_idx] > 1) {
-            exit_with_error("directory appears more than once in file system.");
+        children[idx] = fork();
+        if (children[idx] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (children[idx] == 0) {
+            dup2(fileno(output[idx]), STDOUT_FILENO);
+            dup2(fileno(output[idx]), STDERR_FILENO);
+            trace_enabled = false;
+            metrics.start_ns = clock_ns(CLOCK_MONOTONIC);
+            worker_threads = share ? share : 1;
+            throttle.io_rate /= count;
+            map_image(image, parts[idx].offset, parts[idx].length);
+            return idx + 1;
+        }
+    }
+
+    bool failed = false;
+    for (uint idx = 0; idx < count; idx++) {
+        int status;
+        char line[1024];
+        waitpid(children[idx], &status, 0);
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        failed |= !ok;
+
+        printf("partition %u (offset %llu, %llu bytes): %s\n", idx + 1, (unsigned long long)parts[idx].offset,
+               (unsigned long long)parts[idx].length, ok ? "ok" : "failed");
+        rewind(output[idx]);
+        while (fgets(line, sizeof(line), output[idx]) != NULL) {
+            printf("  %s", line);
+        }
+        fclose(output[idx]);
+    }
+    trace_span("phase", "check partitions", span, 0, count);
+    // Each partition was counted as an image by its own child
+    metrics.enabled = false;
+    exit(failed ? 1 : 0);
+}
+
+// Frees what a check holds until it ends, including what an error that
+// unwound the check through the trap left behind.
+void check_release(void) {
+    free(parent_map);
+    parent_map = NULL;
+    free(directory_scratch.stack);
+    free(directory_scratch.references);
+    free(directory_scratch.subdirectories);
+    directory_scratch.stack = NULL;
+    directory_scratch.references = NULL;
+    directory_scratch.subdirectories = NULL;
+    free_gathered_addresses();
+}
+
+// Runs every consistency check on a loaded image, exiting on the first error.
+void check_image(img_pointers *image) {
+    struct superblock *sb = image->sb;
+    char *inodeblocks = block_addr(image, 2);
+    char *bitmapblocks = block_addr(image, 2 + image->geo.ninodeblocks);
+    uint startingblock = image->geo.data_start;
+    diagnostic_image = image;
+
+    uint64_t span = trace_begin();
+    validate_inodes(inodeblocks, bitmapblocks, image, sb);
+    trace_span("phase", "inode scan", span, 0, sb->ninodes);
+
+    span = trace_begin();
+    gather_addresses(inodeblocks, image, sb, startingblock);
+    trace_span("phase", "address gather", span, 0, sb->ninodes);
+
+    span = trace_begin();
+    verify_bitmap_usage(inodeblocks, bitmapblocks, image, sb, startingblock);
+    trace_span("phase", "bitmap reconcile", span, startingblock, startingblock + sb->nblocks);
+
+    span = trace_begin();
+    validate_block_address_uniqueness(inodeblocks, image, sb, startingblock);
+    trace_span("phase", "uniqueness", span, startingblock, startingblock + sb->nblocks);
+    free_gathered_addresses();
+
+    span = trace_begin();
+    validate_directory_rules(inodeblocks, image, sb);
+    trace_span("phase", "directory traversal", span, 0, sb->ninodes);
+
+    current_site = (error_site){ 0, 0 };
+    check_release();
+    metrics.result = "ok";
+}
+
+void usage(void) {
+    fprintf(stderr,
+            "Usage: fcheck [options] <file_system_image>\n"
+            "  --threads N             worker threads for parallel passes\n"
+            "  --digest                print the Merkle hash of the file tree\n"
+            "  --extract PATH DEST     copy a file or subtree out of the image\n"
+            "  --cache FILE            reuse local check verdicts across images\n"
+            "  --seal                  write CRC32C values of allocated blocks to <image>.seal\n"
+            "  --verify-seal           verify the blocks against <image>.seal\n"
+            "  --io-rate BYTES[K|M|G]  limit image reads to this many bytes per second\n"
+            "  --cpu-share PERCENT     limit each thread to this share of a CPU\n"
+            "  --trace FILE            write a Chrome trace-event timeline of the run\n"
+            "  --mem-report            print memory used per structure on exit\n"
+            "  --diff OLD_IMAGE        compare OLD_IMAGE with the image instead of checking\n"
+            "  --manifest FILE         verify paths, types, sizes and hashes against FILE\n"
+            "  --shell                 load the image and answer queries from stdin\n"
+            "  --replay TRACE          check the image after each block write in TRACE\n"
+            "  --delta FILE            check the image with the blocks in FILE overlaid\n"
+            "  --kernels NAME          use the generic, sse2, avx2 or avx512 kernels\n"
+            "  --export DIR            write inodes, dirents and extents as column files to DIR\n"
+            "  --audit-free-inodes     require every free inode to be zeroed\n"
+            "  --audit-free-blocks     require every free data block to be zeroed\n"
+            "  --dedup-report          list identical data blocks and their owners\n"
+            "  --metrics FILE          add this run to Prometheus metrics in FILE\n");
+    exit(1);
+}
+
+#ifdef FCHECK_FUZZ
+// Fuzzing entry point, for libFuzzer or AFL++ through its libFuzzer driver:
+//   clang -g -O1 -fsanitize=fuzzer,address -DFCHECK_FUZZ fcheck.c -o fcheck_fuzz
+// Each input is checked as an image from memory, and check_release frees
+// what an error unwound through the trap left allocated. Apart from
+// crashes and leaks, an input fails if it runs longer than FUZZ_BASE_NS
+// plus FUZZ_NS_PER_MB per MB of image, or if the bytes it allocates in
+// total, as tallied for --mem-report, exceed FUZZ_BASE_BYTES plus
+// FUZZ_BYTES_PER_BYTE per byte of image. The total bounds peak memory from
+// above. Such inputs are first saved to $FCHECK_FUZZ_REGRESSIONS (default
+// fuzz-regressions). Adding -DFCHECK_FUZZ_REPLAY gives a main that runs
+// the harness on each file named, for builds without libFuzzer.
+#ifndef FUZZ_BASE_NS
+#define FUZZ_BASE_NS 1000000000ull
+#endif
+#ifndef FUZZ_NS_PER_MB
+#define FUZZ_NS_PER_MB 2000000000ull
+#endif
+#ifndef FUZZ_BASE_BYTES
+#define FUZZ_BASE_BYTES (1ull << 20)
+#endif
+#ifndef FUZZ_BYTES_PER_BYTE
+#define FUZZ_BYTES_PER_BYTE 16
+#endif
+
+typedef struct _fuzz_watchdog {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    bool done;
+    uint64_t deadline_ns;
+    const uint8_t *data;
+    size_t size;
+} fuzz_watchdog;
+
+int fuzz_fd = -1;
+
+// Saves an input that broke a bound and aborts, so the fuzzer reports it too.
+void fuzz_regression(const uint8_t *data, size_t size, const char *reason) {
+    const char *dir = getenv("FCHECK_FUZZ_REGRESSIONS");
+    if (dir == NULL) dir = "fuzz-regressions";
+    char path[strlen(dir) + 24];
+    snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)hash_bytes(data, size, 0));
+
+    mkdir(dir, 0755);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(data, 1, size, file) != size || fclose(file) != 0) {
+        perror(path);
+    }
+    fprintf(stderr, "fuzz: %s, input saved to %s\n", reason, path);
+    abort();
+}
+
+// Fails the input if the check is still running at the deadline. A hang
+// never returns to the assertions below, so it is caught from this thread.
+void *fuzz_watch(void *arg) {
+    fuzz_watchdog *watchdog = arg;
+    struct timespec deadline = { watchdog->deadline_ns / 1000000000ull, watchdog->deadline_ns % 1000000000ull };
+
+    pthread_mutex_lock(&watchdog->lock);
+    while (!watchdog->done) {
+        if (pthread_cond_timedwait(&watchdog->done_cond, &watchdog->lock, &deadline) == ETIMEDOUT && !watchdog->done) {
+            fuzz_regression(watchdog->data, watchdog->size, "runtime bound exceeded");
+        }
+    }
+    pthread_mutex_unlock(&watchdog->lock);
+    return NULL;
+}
+
+uint64_t fuzz_allocated(void) {
+    uint64_t total = 0;
+    for (int category = 0; category < MEM_CATEGORIES; category++) {
+        total += __atomic_load_n(&mem_allocated[category], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (fuzz_fd < 0) {
+        worker_threads = 1;
+        kernels_init(NULL);
+        fuzz_fd = memfd_create("fcheck-fuzz", MFD_CLOEXEC);
+        if (fuzz_fd < 0) {
+            perror("memfd_create");
+            abort();
         }
     }
+    if (ftruncate(fuzz_fd, 0) != 0 || ftruncate(fuzz_fd, size) != 0
+        || (size > 0 && pwrite(fuzz_fd, data, size, 0) != (ssize_t)size)) {
+        perror("fuzz input");
+        abort();
+    }
+
+    // The watchdog's deadline is on CLOCK_REALTIME, as pthread_cond_timedwait expects
+    fuzz_watchdog watchdog = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false,
+                               clock_ns(CLOCK_REALTIME) + FUZZ_BASE_NS + (uint64_t)(FUZZ_NS_PER_MB * (size / 1048576.0)),
+                               data, size };
+    pthread_t watcher;
+    pthread_create(&watcher, NULL, fuzz_watch, &watchdog);
+
+    img_pointers image = { 0 };
+    jmp_buf trap;
+    uint64_t allocated = fuzz_allocated();
+    image.fd = fuzz_fd;
+    error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        map_image(&image, 0, size);
+        check_image(&image);
+    }
+    error_trap = NULL;
+    allocated = fuzz_allocated() - allocated;
+
+    pthread_mutex_lock(&watchdog.lock);
+    watchdog.done = true;
+    pthread_cond_signal(&watchdog.done_cond);
+    pthread_mutex_unlock(&watchdog.lock);
+    pthread_join(watcher, NULL);
+
+    if (image.mapping != NULL) munmap(image.mapping, image.map_length);
+    free(image.read_blocks);
+    check_release();
+    current_site = (error_site){ 0, 0 };
+    diagnostic_image = NULL;
+
+    if (allocated > FUZZ_BASE_BYTES + (uint64_t)FUZZ_BYTES_PER_BYTE * size) {
+        fuzz_regression(data, size, "allocation bound exceeded");
+    }
+    return 0;
 }
 
+#ifdef FCHECK_FUZZ_REPLAY
+int main(int argc, char *argv[]) {
+    for (int arg = 1; arg < argc; arg++) {
+        FILE *file = fopen(argv[arg], "rb");
+        struct stat st;
+        if (file == NULL || fstat(fileno(file), &st) != 0) {
+            perror(argv[arg]);
+            return 1;
+        }
+        uint8_t *data = malloc(st.st_size > 0 ? st.st_size : 1);
+        if (data == NULL || fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+            perror(argv[arg]);
+            return 1;
+        }
+        fclose(file);
+        LLVMFuzzerTestOneInput(data, st.st_size);
+        free(data);
+    }
+    return 0;
+}
+#endif
+#endif
 
+#if !defined(FCHECK_LIBRARY) && !defined(FCHECK_FUZZ)
 int main(int argc, char *argv[]) {
-    int fsfd;
-    struct stat fileStat;
     img_pointers image;
-    char *mmapimage;
-    struct superblock *sb;
-    
-    uint numinodeblocks, startingblock;
-    char *inodeblocks, *bitmapblocks;
+    bool digest = false;
+    bool seal = false, verify = false;
+    uint64_t io_rate = 0;
+    uint cpu_share = 0;
+    bool report_memory = false;
+    const char *cache_path = NULL;
+    const char *diff_base = NULL;
+    const char *manifest_path = NULL;
+    const char *replay_path = NULL;
+    const char *kernel_name = NULL;
+    const char *export_dir = NULL;
+    export_state export;
+    const char **deltas = NULL;
+    uint ndeltas = 0;
+    path_index paths;
+    bool shell = false;
+    bool audit_inodes = false, audit_blocks = false;
+    bool dedup_report = false;
+    verdict_cache cache;
+    const char *extract_source = NULL, *extract_dest = NULL;
+
+    static struct option long_options[] = {
+        { "digest", no_argument, NULL, 'd' },
+        { "threads", required_argument, NULL, 't' },
+        { "extract", required_argument, NULL, 'x' },
+        { "cache", required_argument, NULL, 'c' },
+        { "seal", no_argument, NULL, 's' },
+        { "verify-seal", no_argument, NULL, 'v' },
+        { "io-rate", required_argument, NULL, 'i' },
+        { "cpu-share", required_argument, NULL, 'u' },
+        { "trace", required_argument, NULL, 'T' },
+        { "mem-report", no_argument, NULL, 'm' },
+        { "diff", required_argument, NULL, 'D' },
+        { "manifest", required_argument, NULL, 'M' },
+        { "shell", no_argument, NULL, 'S' },
+        { "replay", required_argument, NULL, 'R' },
+        { "delta", required_argument, NULL, 'L' },
+        { "kernels", required_argument, NULL, 'K' },
+        { "export", required_argument, NULL, 'E' },
+        { "audit-free-inodes", no_argument, NULL, 'a' },
+        { "audit-free-blocks", no_argument, NULL, 'b' },
+        { "dedup-report", no_argument, NULL, 'p' },
+        { "metrics", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
 
     if (argc < 2) {
         fprintf(stderr, "Usage: fcheck <file_system_image>\n");
         exit(1);
     }
 
-    fsfd = open(argv[1], O_RDONLY);
-    if (fsfd < 0) {
-        fprintf(stderr, "image not found\n");
-        exit(1);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            digest = true;
+            break;
+        case 't':
+            worker_threads = atoi(optarg);
+            break;
+        case 's':
+            seal = true;
+            break;
+        case 'v':
+            verify = true;
+            break;
+        case 'i': {
+            char *suffix;
+            io_rate = strtoull(optarg, &suffix, 10);
+            if (*suffix == 'K' || *suffix == 'k') io_rate <<= 10;
+            if (*suffix == 'M' || *suffix == 'm') io_rate <<= 20;
+            if (*suffix == 'G' || *suffix == 'g') io_rate <<= 30;
+            break;
+        }
+        case 'u':
+            cpu_share = atoi(optarg);
+            if (cpu_share > 100) usage();
+            break;
+        case 'a':
+            audit_inodes = true;
+            break;
+        case 'b':
+            audit_blocks = true;
+            break;
+        case 'p':
+            dedup_report = true;
+            break;
+        case 'P':
+            metrics_start(optarg);
+            break;
+        case 'E':
+            export_dir = optarg;
+            break;
+        case 'K':
+            kernel_name = optarg;
+            break;
+        case 'L':
+            deltas = realloc(deltas, (ndeltas + 1) * sizeof(*deltas));
+            deltas[ndeltas++] = optarg;
+            break;
+        case 'R':
+            replay_path = optarg;
+            break;
+        case 'S':
+            shell = true;
+            break;
+        case 'M':
+            manifest_path = optarg;
+            break;
+        case 'D':
+            diff_base = optarg;
+            break;
+        case 'm':
+            report_memory = true;
+            break;
+        case 'T':
+            trace_start(optarg);
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 'x':
+            if (optind >= argc) usage();
+            extract_source = optarg;
+            extract_dest = argv[optind++];
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
     }
 
-    if (fstat(fsfd, &fileStat) < 0) {
-        exit(1);
+    kernels_init(kernel_name);
+    if (io_rate != 0 || cpu_share != 0) {
+        throttle_start(io_rate, cpu_share);
     }
 
-    mmapimage = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
-    if (mmapimage == MAP_FAILED) {
-        perror("mmap failed");
-        exit(1);
+    if (report_memory) {
+        image.mapping = NULL;
+        mem_report_image = &image;
+        atexit(mem_report);
     }
 
-    image.mmapimage=mmapimage;
-    sb = (struct superblock *)(mmapimage + 1 * BLOCK_SIZE);
-    numinodeblocks = (sb->ninodes / (IPB)) + 1;
- 
-    inodeblocks = (char *)(mmapimage + 2 * BLOCK_SIZE);
-    
-    bitmapblocks = (char *)(inodeblocks + numinodeblocks * BLOCK_SIZE);
-    startingblock = ((sb->ninodes/(IPB))+1)+((sb->size/(BPB))+1)+2;
+    if (diff_base != NULL) {
+        img_pointers base;
+        load_image(diff_base, &base);
+        load_image(argv[optind], &image);
+        exit(diff_images(&base, &image) ? 1 : 0);
+    }
+
+    uint partition_number = load_partitioned_image(argv[optind], &image, shell || extract_source != NULL || replay_path != NULL || ndeltas > 0);
+    metrics.image_bytes = (uint64_t)image.sb->size * BLOCK_SIZE;
+    if (replay_path != NULL) {
+        check_image(&image);
+        uint64_t span = trace_begin();
+        replay_trace(&image, replay_path);
+        trace_span("phase", "replay", span, 0, 0);
+        exit(0);
+    }
+    if (ndeltas > 0) {
+        check_image(&image);
+        exit(check_deltas(&image, deltas, ndeltas) ? 0 : 1);
+    }
+    if (cache_path != NULL) {
+        verdict_cache_open(&cache, cache_path, image.sb);
+        active_cache = &cache;
+    }
+    if (shell) {
+        run_shell(&image);
+        exit(0);
+    }
+    if (manifest_path != NULL) {
+        path_index_init(&paths, image.sb->ninodes);
+        active_path_index = &paths;
+    }
+    char export_subdir[4096];
+    if (export_dir != NULL) {
+        // Each partition exports into its own subdirectory
+        if (partition_number != 0) {
+            if (mkdir(export_dir, 0755) < 0 && errno != EEXIST) export_failed(export_dir);
+            snprintf(export_subdir, sizeof(export_subdir), "%s/p%u", export_dir, partition_number);
+            export_dir = export_subdir;
+        }
+        export_open(&export, export_dir);
+        active_export = &export;
+    }
+    check_image(&image);
+    if (active_export != NULL) {
+        export_finish(active_export);
+    }
+    if (active_cache != NULL) {
+        verdict_cache_save(active_cache);
+    }
 
-    validate_inodes(inodeblocks, bitmapblocks, mmapimage, sb);
-    verify_bitmap_usage(inodeblocks, bitmapblocks, mmapimage, sb, startingblock);
-    validate_block_address_uniqueness(inodeblocks, mmapimage, sb, startingblock);
-    validate_directory_rules(inodeblocks, &image, sb);
+    uint64_t span = trace_begin();
+    if (audit_inodes) {
+        audit_free_inodes(&image);
+        trace_span("phase", "audit free inodes", span, 0, 0);
+    }
+    span = trace_begin();
+    if (audit_blocks) {
+        audit_free_blocks(&image);
+        trace_span("phase", "audit free blocks", span, 0, 0);
+    }
+    span = trace_begin();
+    if (dedup_report) {
+        print_dedup_report(&image);
+        trace_span("phase", "dedup report", span, 0, 0);
+    }
+    span = trace_begin();
+    if (manifest_path != NULL) {
+        verify_manifest(&image, &paths, manifest_path);
+        trace_span("phase", "manifest", span, 0, 0);
+    }
+    span = trace_begin();
+    if (digest) {
+        print_tree_digest(&image);
+        trace_span("phase", "digest", span, 0, 0);
+    }
+    span = trace_begin();
+    if (extract_source != NULL) {
+        extract_path(&image, extract_source, extract_dest);
+        trace_span("phase", "extract", span, 0, 0);
+    }
+    if (seal || verify) {
+        char seal_path[strlen(argv[optind]) + sizeof(".p000.seal")];
+        if (partition_number != 0) {
+            snprintf(seal_path, sizeof(seal_path), "%s.p%u.seal", argv[optind], partition_number);
+        } else {
+            snprintf(seal_path, sizeof(seal_path), "%s.seal", argv[optind]);
+        }
+        crc32c_init();
+        span = trace_begin();
+        if (seal) {
+            seal_image(&image, seal_path);
+        } else {
+            verify_seal(&image, seal_path);
+        }
+        trace_span("phase", seal ? "seal" : "verify seal", span, 0, 0);
+    }
 
     exit(0);
 }
+#endif
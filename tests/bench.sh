@@ -0,0 +1,146 @@
+#!/bin/bash
+# Benchmarks fcheck on synthetic images of several sizes and compares the
+# results with tests/bench_baseline.txt, failing on a regression.
+#
+#   tests/bench.sh [path/to/fcheck] [--update]
+#
+# With --update, the baseline is rewritten from this run instead.
+#
+# mem: bytes allocated per --mem-report (exact, so allowed 10% growth) and
+# peak RSS (allowed 25% plus 1 MB, as it depends on the allocator and on
+# the page cache).
+#
+# time: wall time of checking each image with one thread, best of three,
+# including huge.img from mkfs.py, which is 4.6 GB sparse with its data past
+# the 4 GB mark (allowed twice the baseline plus 50 ms, as shared hosts
+# time unevenly). The corpus row is the wall time of the fuzzing harness,
+# built without sanitizers with -DFCHECK_FUZZ_REPLAY, replaying what
+# tests/fuzz.sh replays: the mkfs.py images but huge*, and the inputs in
+# tests/fuzz-regressions. It is skipped, with a message, if the harness
+# does not build; $CFLAGS is passed to the compiler as in fuzz.sh.
+#
+# threads: CPU time of the check of the largest image at several thread
+# counts, best of three. Work is split between threads rather than
+# repeated by each, so the CPU time may not grow past twice that of one
+# thread (plus 20 ms of thread start-up).
+#
+# numa: on a host with two or more NUMA nodes, wall time of the check of
+# the largest image with twice the CPUs of node 0 in threads, confined to
+# node 0 by taskset and then spread over nodes 0 and 1, best of three.
+# Pinned workers touch their own slices in node-local memory, so two
+# sockets may not be slower than one (allowed 10% plus 20 ms). Skipped,
+# with a message, on a single node or without taskset.
+FCHECK=$(realpath "${1:-./fcheck}")
+TESTS=$(dirname "$(realpath "$0")")
+BASELINE="$TESTS/bench_baseline.txt"
+UPDATE=0
+[ "$2" = "--update" ] && UPDATE=1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+SIZES="8192 65536 524288"
+for size in $SIZES; do
+    python3 -c "import sys; sys.path.insert(0, sys.argv[1]); import mkfs; mkfs.synthetic(int(sys.argv[2])).write(sys.argv[3])" \
+        "$TESTS" "$size" "$WORK/$size.img" || exit 1
+done
+python3 -c "import sys; sys.path.insert(0, sys.argv[1]); import mkfs; mkfs.build(sys.argv[2], 'huge')" "$TESTS" "$WORK" || exit 1
+mkdir "$WORK/corpus"
+python3 "$TESTS/mkfs.py" "$WORK/corpus" || exit 1
+rm -f "$WORK"/corpus/huge*.img "$WORK"/corpus/*.delta
+cp "$TESTS"/fuzz-regressions/* "$WORK/corpus/" 2> /dev/null
+
+# Seconds of the best of three runs of a command, in milliseconds; format
+# is %3R for wall time or %3U for user CPU time
+best_ms() {
+    local format=$1 best= ms
+    shift
+    for _ in 1 2 3; do
+        ms=$( { TIMEFORMAT=$format; time "$@" > /dev/null 2>&1; } 2>&1 | tr -d .)
+        ms=$((10#$ms))
+        [ -z "$best" ] || [ "$ms" -lt "$best" ] && best=$ms
+    done
+    echo "$best"
+}
+
+results="$WORK/results"
+: > "$results"
+for size in $SIZES; do
+    report=$("$FCHECK" --threads 1 --mem-report "$WORK/$size.img" 2>&1) || { echo "fcheck failed on $size.img"; exit 1; }
+    allocated=$(printf '%s\n' "$report" | awk '/total allocated/ { print $3 }')
+    rss=$(printf '%s\n' "$report" | awk '/peak RSS/ { print $3 }')
+    echo "mem $size $allocated $rss" >> "$results"
+done
+for image in $SIZES huge; do
+    echo "time $image $(best_ms %3R "$FCHECK" --threads 1 "$WORK/$image.img")" >> "$results"
+done
+if gcc $CFLAGS -O -DFCHECK_FUZZ -DFCHECK_FUZZ_REPLAY "$TESTS/../fcheck.c" -o "$WORK/replay" -pthread 2> /dev/null; then
+    echo "time corpus $(best_ms %3R "$WORK/replay" "$WORK"/corpus/*)" >> "$results"
+else
+    corpus_skipped=1
+fi
+
+printf '%-4s %8s %14s %12s\n' "" blocks allocated "peak RSS KB"
+failed=0
+while read -r kind size allocated rss; do
+    [ "$kind" = mem ] || continue
+    printf '%-4s %8s %14s %12s' "$kind" "$size" "$allocated" "$rss"
+    base=$(awk -v kind="$kind" -v size="$size" '$1 == kind && $2 == size' "$BASELINE" 2> /dev/null)
+    if [ $UPDATE = 0 ] && [ -n "$base" ]; then
+        read -r _ _ base_allocated base_rss <<< "$base"
+        if [ "$allocated" -gt $((base_allocated * 11 / 10)) ] || [ "$rss" -gt $((base_rss * 5 / 4 + 1024)) ]; then
+            printf '  REGRESSION (baseline %s, %s)' "$base_allocated" "$base_rss"
+            failed=1
+        fi
+    fi
+    printf '\n'
+done < "$results"
+
+printf '\n%-4s %8s %12s\n' "" image "wall ms"
+while read -r kind image ms; do
+    [ "$kind" = time ] || continue
+    printf '%-4s %8s %12s' "$kind" "$image" "$ms"
+    base=$(awk -v image="$image" '$1 == "time" && $2 == image { print $3 }' "$BASELINE" 2> /dev/null)
+    if [ $UPDATE = 0 ] && [ -n "$base" ] && [ "$ms" -gt $((base * 2 + 50)) ]; then
+        printf '  REGRESSION (baseline %s)' "$base"
+        failed=1
+    fi
+    printf '\n'
+done < "$results"
+[ -n "$corpus_skipped" ] && printf '%-4s %8s %12s\n' time corpus "skipped, the fuzzing harness did not build (set \$CFLAGS)"
+
+largest=${SIZES##* }
+printf '\n%-7s %8s %12s\n' "" threads "CPU ms"
+single=$(best_ms %3U "$FCHECK" --threads 1 "$WORK/$largest.img")
+printf '%-7s %8s %12s\n' threads 1 "$single"
+for threads in 4 16 64; do
+    ms=$(best_ms %3U "$FCHECK" --threads $threads "$WORK/$largest.img")
+    printf '%-7s %8s %12s' threads "$threads" "$ms"
+    if [ "$ms" -gt $((single * 2 + 20)) ]; then
+        printf '  REGRESSION (%s ms with 1 thread)' "$single"
+        failed=1
+    fi
+    printf '\n'
+done
+
+NODES=/sys/devices/system/node
+nnodes=$(ls -d "$NODES"/node[0-9]* 2> /dev/null | wc -l)
+if [ "$nnodes" -lt 2 ] || ! command -v taskset > /dev/null; then
+    printf '\nnuma: skipped, the 1 and 2 socket comparison needs 2 NUMA nodes and taskset (%s node(s) here)\n' "$nnodes"
+else
+    node0=$(cat "$NODES/node0/cpulist")
+    node1=$(cat "$NODES/node1/cpulist")
+    threads=$(( $(taskset -c "$node0" nproc) * 2 ))
+    printf '\n%-7s %8s %12s\n' "" sockets "wall ms"
+    one=$(best_ms %3R taskset -c "$node0" "$FCHECK" --threads $threads "$WORK/$largest.img")
+    printf '%-7s %8s %12s\n' numa 1 "$one"
+    two=$(best_ms %3R taskset -c "$node0,$node1" "$FCHECK" --threads $threads "$WORK/$largest.img")
+    printf '%-7s %8s %12s' numa 2 "$two"
+    if [ "$two" -gt $((one * 11 / 10 + 20)) ]; then
+        printf '  REGRESSION (%s ms on 1 socket)' "$one"
+        failed=1
+    fi
+    printf '\n'
+fi
+
+[ $UPDATE = 1 ] && cp "$results" "$BASELINE"
+exit $failed
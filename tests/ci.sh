@@ -0,0 +1,18 @@
+#!/bin/bash
+# Builds fcheck and runs the regression tests and the fuzz corpus, for CI.
+# Exits with 1 if any of them fails.
+#
+#   tests/ci.sh
+#
+# $CFLAGS is passed to the compiler, e.g. -I for the xv6 headers.
+# tests/bench.sh is left out, as shared CI runners time too unevenly.
+TESTS=$(dirname "$(realpath "$0")")
+ROOT=$(dirname "$TESTS")
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+gcc $CFLAGS "$ROOT/fcheck.c" -o "$BUILD/fcheck" -Wall -Werror -O -pthread || exit 1
+failed=0
+"$TESTS/run.sh" "$BUILD/fcheck" || failed=1
+FUZZ_SECONDS=${FUZZ_SECONDS:-60} "$TESTS/fuzz.sh" "$ROOT/fcheck.c" || failed=1
+exit $failed
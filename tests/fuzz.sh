@@ -0,0 +1,42 @@
+#!/bin/bash
+# Runs the fuzzing harness of fcheck.c (-DFCHECK_FUZZ) under
+# AddressSanitizer, with leak checks, over a seed corpus of the mkfs.py
+# images and the saved inputs in tests/fuzz-regressions. If clang has
+# libFuzzer, it then fuzzes from that corpus for $FUZZ_SECONDS (default
+# 60). Inputs that crash or break a bound are saved to
+# tests/fuzz-regressions, to be committed and replayed by later runs.
+#
+#   tests/fuzz.sh [path/to/fcheck.c]
+#
+# $CFLAGS is passed to the compiler, e.g. -I for the xv6 headers.
+SOURCE=$(realpath "${1:-./fcheck.c}")
+TESTS=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export FCHECK_FUZZ_REGRESSIONS="$TESTS/fuzz-regressions"
+export ASAN_OPTIONS=detect_leaks=1
+
+# The 4.6 GB images would be read into memory whole
+mkdir "$WORK/images" "$WORK/corpus"
+python3 "$TESTS/mkfs.py" "$WORK/images" || exit 1
+for image in "$WORK"/images/*.img; do
+    case $(basename "$image") in
+        huge*) ;;
+        *) cp "$image" "$WORK/corpus/" ;;
+    esac
+done
+
+gcc $CFLAGS -g -O1 -fsanitize=address -DFCHECK_FUZZ -DFCHECK_FUZZ_REPLAY "$SOURCE" -o "$WORK/replay" -pthread || exit 1
+if ! "$WORK/replay" "$WORK"/corpus/* $(ls "$FCHECK_FUZZ_REGRESSIONS"/* 2> /dev/null); then
+    echo "FAIL fuzz corpus replay"
+    exit 1
+fi
+echo "ok   fuzz corpus replay"
+
+if clang $CFLAGS -g -O1 -fsanitize=fuzzer,address -DFCHECK_FUZZ "$SOURCE" -o "$WORK/fuzz" -pthread 2> /dev/null; then
+    mkdir -p "$FCHECK_FUZZ_REGRESSIONS"
+    "$WORK/fuzz" -max_total_time="${FUZZ_SECONDS:-60}" -artifact_prefix="$FCHECK_FUZZ_REGRESSIONS/" "$WORK/corpus" || exit 1
+    echo "ok   fuzzing for ${FUZZ_SECONDS:-60} s"
+else
+    echo "skip fuzzing: clang with libFuzzer not found"
+fi
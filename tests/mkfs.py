@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+# Builds the xv6 test images for run.sh: a small, consistent file system and
+# copies of it with one inconsistency each. Images are written sparse, so the
+# large ones take no more disk than the small ones.
+#
+#   tests/mkfs.py <dir>    writes <dir>/<case>.img for every case below, and
+#                          <dir>/<case>.delta for those with good.img's layout
+import os
+import struct
+import sys
+
+BSIZE = 512
+IPB = 8
+BPB = BSIZE * 8
+T_DIR, T_FILE, T_DEV = 1, 2, 3
+
+
+class Image:
+    """The layout mkfs uses: boot block, superblock, inodes, bitmap, data, log."""
+
+    def __init__(self, size=1024, ninodes=200, nlog=10, high=False):
+        self.size, self.ninodes = size, ninodes
+        self.bitmap_blocks = size // BPB + 1
+        self.data_start = ninodes // IPB + 3 + self.bitmap_blocks
+        self.nblocks = size - self.data_start - nlog
+        self.blocks = {}
+        self.inodes = {}
+        self.allocated = list(range(self.data_start))
+        # With high set, data goes near the end of the disk to reach the
+        # block addresses whose byte offsets do not fit in 32 bits
+        self.next_block = size - nlog - 200 if high else self.data_start
+        self.next_inode = 1
+        self.block(1)[0:16] = struct.pack('<IIII', size, self.nblocks, ninodes, nlog)
+
+    def block(self, address):
+        if address not in self.blocks:
+            self.blocks[address] = bytearray(BSIZE)
+        return self.blocks[address]
+
+    def balloc(self):
+        address = self.next_block
+        self.next_block += 1
+        self.block(address)
+        self.allocated.append(address)
+        return address
+
+    def ialloc(self, type):
+        inum = self.next_inode
+        self.next_inode += 1
+        self.inodes[inum] = dict(type=type, nlink=1, size=0, addrs=[0] * 13, data=bytearray())
+        return inum
+
+    def append(self, inum, data):
+        self.inodes[inum]['data'] += data
+
+    def link(self, parent, inum, name):
+        self.append(parent, struct.pack('<H14s', inum, name.encode()))
+
+    def mkdir(self, parent, name):
+        inum = self.ialloc(T_DIR)
+        self.link(inum, inum, '.')
+        self.link(inum, parent, '..')
+        self.link(parent, inum, name)
+        self.inodes[parent]['nlink'] += 1
+        return inum
+
+    def layout(self):
+        """Gives every inode its data blocks and marks them in the bitmap."""
+        for inode in self.inodes.values():
+            data = inode['data']
+            inode['size'] = len(data)
+            addresses = []
+            for offset in range(0, len(data), BSIZE):
+                address = self.balloc()
+                chunk = data[offset:offset + BSIZE]
+                self.block(address)[:len(chunk)] = chunk
+                addresses.append(address)
+            inode['addrs'][:min(12, len(addresses))] = addresses[:12]
+            if len(addresses) > 12:
+                indirect = self.balloc()
+                inode['addrs'][12] = indirect
+                for idx, address in enumerate(addresses[12:]):
+                    struct.pack_into('<I', self.block(indirect), 4 * idx, address)
+        for address in self.allocated:
+            self.set_bit(address, True)
+        for inum in self.inodes:
+            self.write_inode(inum)
+
+    def set_bit(self, address, value):
+        bitmap = self.block(self.data_start - self.bitmap_blocks + address // BPB)
+        if value:
+            bitmap[(address % BPB) // 8] |= 1 << (address % 8)
+        else:
+            bitmap[(address % BPB) // 8] &= ~(1 << (address % 8))
+
+    def write_inode(self, inum):
+        inode = self.inodes[inum]
+        struct.pack_into('<hhhhI13I', self.block(2 + inum // IPB), (inum % IPB) * 64,
+                         inode['type'], 0, 0, inode['nlink'], inode['size'], *inode['addrs'])
+
+    def write(self, path, file_blocks=None):
+        with open(path, 'wb') as file:
+            file.truncate((file_blocks or self.size) * BSIZE)
+            for address, data in self.blocks.items():
+                file.seek(address * BSIZE)
+                file.write(data)
+
+
+def sample(**geometry):
+    """/README, /console, /sub/big (with an indirect block), /sub/link (a
+    second link to /README), /sub/deep/copy and /sub/deep/empty."""
+    image = Image(**geometry)
+    root = image.ialloc(T_DIR)
+    image.link(root, root, '.')
+    image.link(root, root, '..')
+    readme = image.ialloc(T_FILE)
+    image.append(readme, b'hello world\n' * 10)
+    image.link(root, readme, 'README')
+    sub = image.mkdir(root, 'sub')
+    big = image.ialloc(T_FILE)
+    image.append(big, bytes((i * 7) & 255 for i in range(BSIZE * 40 + 100)))
+    image.link(sub, big, 'big')
+    image.link(sub, readme, 'link')
+    image.inodes[readme]['nlink'] = 2
+    deep = image.mkdir(sub, 'deep')
+    copy = image.ialloc(T_FILE)
+    image.append(copy, b'hello world\n' * 10)
+    image.link(deep, copy, 'copy')
+    console = image.ialloc(T_DEV)
+    image.link(root, console, 'console')
+    empty = image.ialloc(T_FILE)
+    image.link(deep, empty, 'empty')
+    image.layout()
+    return image
+
+
+def chain(depth, **geometry):
+    """Directories nested depth deep: /d/d/d/..."""
+    image = Image(**geometry)
+    parent = image.ialloc(T_DIR)
+    image.link(parent, parent, '.')
+    image.link(parent, parent, '..')
+    for _ in range(depth):
+        parent = image.mkdir(parent, 'd')
+    image.layout()
+    return image
+
+
+def synthetic(size):
+    """A populated image of size blocks for the benchmarks: a quarter of the
+    data region in files of 1 to 40 blocks, 64 files to a directory."""
+    image = Image(size=size, ninodes=max(200, size // 32))
+    root = image.ialloc(T_DIR)
+    image.link(root, root, '.')
+    image.link(root, root, '..')
+    budget, count, directory = image.nblocks // 4, 0, root
+    while budget > 0 and image.next_inode < image.ninodes - 1:
+        if count % 64 == 0:
+            directory = image.mkdir(root, 'd%d' % (count // 64))
+        length = min(budget, 1 + count % 40)
+        inum = image.ialloc(T_FILE)
+        image.append(inum, bytes([count % 251]) * (length * BSIZE))
+        image.link(directory, inum, 'f%d' % count)
+        budget -= length + (1 if length > 12 else 0)
+        count += 1
+    image.layout()
+    return image
+
+
+# Inode numbers in the sample image
+ROOT, README, SUB, BIG, DEEP, COPY = 1, 2, 3, 4, 5, 6
+
+
+def set_field(field, value, inum=README):
+    def mutate(image):
+        image.inodes[inum][field] = value
+        image.write_inode(inum)
+    return mutate
+
+
+def set_address(value, inum=README):
+    def mutate(image):
+        image.inodes[inum]['addrs'][0] = value
+        image.write_inode(inum)
+    return mutate
+
+
+def add_entry(directory, inum, name):
+    """Writes an extra entry into the first free slot of directory's first block."""
+    def mutate(image):
+        block = image.block(image.inodes[directory]['addrs'][0])
+        for offset in range(0, BSIZE, 16):
+            if struct.unpack_from('<H', block, offset)[0] == 0:
+                struct.pack_into('<H14s', block, offset, inum, name.encode())
+                return
+    return mutate
+
+
+def hostile_name(image):
+    """A consistent image with a link to /README named to escape --extract's
+    destination."""
+    add_entry(ROOT, README, '../../pwned')(image)
+    set_field('nlink', 3)(image)
+
+
+def free_bit(image):
+    image.set_bit(image.inodes[README]['addrs'][0], False)
+
+
+def dup_direct(image):
+    image.inodes[COPY]['addrs'][0] = image.inodes[README]['addrs'][0]
+    image.write_inode(COPY)
+
+
+def dup_direct_freed(image):
+    image.set_bit(image.inodes[COPY]['addrs'][0], False)
+    dup_direct(image)
+
+
+def dup_indirect(image):
+    block = image.block(image.inodes[BIG]['addrs'][12])
+    first, second = struct.unpack_from('<II', block, 0)
+    struct.pack_into('<I', block, 4, first)
+    image.set_bit(second, False)
+
+
+def free_bit_then_bad_type(image):
+    """Point 5 for /README and Point 1 for a later inode: the full check meets
+    /README first."""
+    free_bit(image)
+    set_field('type', 5, inum=COPY)(image)
+
+
+def orphan(image):
+    image.inodes[50] = dict(type=T_FILE, nlink=1, size=0, addrs=[0] * 13)
+    image.write_inode(50)
+
+
+def nlink_then_orphan(image):
+    """Point 11 for /README and Point 9 for a later inode, in the order the
+    directory traversal meets them."""
+    set_field('nlink', 3)(image)
+    orphan(image)
+
+
+# name -> (mutation, geometry, file size in blocks)
+CASES = {
+    'good': (None, {}, None),
+    'badtype': (set_field('type', 5), {}, None),
+    'baddirect': (set_address(5000), {}, None),
+    'metaaddr': (set_address(3), {}, None),
+    'logaddr': (set_address(1020), {}, None),
+    'freebit': (free_bit, {}, None),
+    'dupdirect': (dup_direct, {}, None),
+    'dupdirect2': (dup_direct_freed, {}, None),
+    'dupind': (dup_indirect, {}, None),
+    'nlink': (set_field('nlink', 3), {}, None),
+    'orphan': (orphan, {}, None),
+    'twoerrors': (free_bit_then_bad_type, {}, None),
+    'twolinks': (nlink_then_orphan, {}, None),
+    'dirtwice': (add_entry(DEEP, SUB, 'loop'), {}, None),
+    # A checker that misses the cycle must not send --digest or --extract
+    # around it forever
+    'rootcycle': (add_entry(SUB, ROOT, 'up'), {}, None),
+    'hostile': (hostile_name, {}, None),
+    # An entry past the end of the inode table
+    'farentry': (add_entry(SUB, 500, 'far'), {}, None),
+    # Same layout as good.img but larger, with data past its end, for --diff
+    'grown': (None, dict(size=1400, high=True), None),
+    # 4.6 GB, with data past the 4 GB mark
+    'huge': (None, dict(size=9000000, high=True), None),
+    'hugebad': (set_field('nlink', 3), dict(size=9000000, high=True), None),
+}
+
+
+def gpt(path, partitions, nentries=128, entry_size=128):
+    """A disk with a protective MBR and a GPT whose entry array fills sectors
+    2 to 33. partitions maps entry indexes to images, laid out one after
+    another from sector 64; an index past the array is written anyway, where
+    only a reader that ignores the array's bounds would find it."""
+    with open(path, 'wb') as file:
+        mbr = bytearray(BSIZE)
+        mbr[446 + 4] = 0xEE
+        struct.pack_into('<II', mbr, 446 + 8, 1, 0xFFFFFFFF)
+        mbr[510:512] = b'\x55\xaa'
+        header = bytearray(BSIZE)
+        header[0:8] = b'EFI PART'
+        struct.pack_into('<QQ', header, 40, 34, 0)
+        struct.pack_into('<QII', header, 72, 2, nentries, entry_size)
+        file.write(mbr + header)
+        sector = 64
+        for index, image in sorted(partitions.items()):
+            entry = struct.pack('<16s16sQQ', b'fcheck', b'part%d' % index, sector, sector + image.size - 1)
+            file.seek(2 * BSIZE + index * entry_size)
+            file.write(entry)
+            for address, data in image.blocks.items():
+                file.seek((sector + address) * BSIZE)
+                file.write(data)
+            sector += image.size
+        file.truncate(sector * BSIZE)
+
+
+def write_delta(path, base, image):
+    """Writes the blocks of image that differ from base as --delta records."""
+    zero = bytes(BSIZE)
+    with open(path, 'wb') as file:
+        for address in sorted(set(base.blocks) | set(image.blocks)):
+            data = bytes(image.blocks.get(address, zero))
+            if data != bytes(base.blocks.get(address, zero)):
+                file.write(struct.pack('<I', address) + data)
+
+
+def build(directory, name):
+    mutate, geometry, file_blocks = CASES[name]
+    image = sample(**geometry)
+    if mutate is not None:
+        mutate(image)
+    image.write(os.path.join(directory, name + '.img'), file_blocks)
+    # The same damage as a delta over good.img, for --delta to find
+    if not geometry:
+        write_delta(os.path.join(directory, name + '.delta'), sample(), image)
+
+
+if __name__ == '__main__':
+    for name in CASES:
+        build(sys.argv[1], name)
+    # Deeper than a recursive walk or a host path could go
+    chain(5000, size=12000, ninodes=5008).write(os.path.join(sys.argv[1], 'deep.img'))
+    # Partitioned disks: a used entry past the entry array, and entries too
+    # small for the GPT entry structure, which are not read at all
+    gpt(os.path.join(sys.argv[1], 'gpt.img'), {0: sample(), 200: sample()}, nentries=0xFFFFFFFF)
+    gpt(os.path.join(sys.argv[1], 'gptsmall.img'), {0: sample()}, entry_size=48)
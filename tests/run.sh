@@ -0,0 +1,170 @@
+#!/bin/bash
+# Checks every image built by mkfs.py and compares the first line of output
+# and the exit code with what fcheck is expected to report.
+#
+#   tests/run.sh [path/to/fcheck]
+FCHECK=$(realpath "${1:-./fcheck}")
+TESTS=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+python3 "$TESTS/mkfs.py" "$WORK" || exit 1
+
+failed=0
+
+# expect <image> <exit code> <first line of output> [options]
+expect() {
+    local image=$1 code=$2 line=$3
+    shift 3
+    local output
+    output=$(cd "$WORK" && timeout 60 "$FCHECK" "$@" "$image.img" 2>&1)
+    local rc=$?
+    if [ "$rc" != "$code" ] || [ "$(printf '%s\n' "$output" | head -n 1)" != "$line" ]; then
+        printf 'FAIL %s %s: rc %s, got "%s"\n' "$image" "$*" "$rc" "$(printf '%s\n' "$output" | head -n 1)"
+        failed=1
+    else
+        printf 'ok   %s %s\n' "$image" "$*"
+    fi
+}
+
+expect good 0 ""
+expect badtype 1 "ERROR: bad inode."
+expect baddirect 1 "ERROR: bad direct address in inode."
+expect metaaddr 1 "ERROR: bad direct address in inode."
+expect logaddr 1 "ERROR: bad direct address in inode."
+expect freebit 1 "ERROR: address used by inode but marked free in bitmap."
+expect dupdirect 1 "ERROR: bitmap marks block in use but it is not in use."
+expect dupdirect2 1 "ERROR: direct address used more than once."
+expect dupind 1 "ERROR: indirect address used more than once."
+expect nlink 1 "ERROR: bad reference count for file."
+expect orphan 1 "ERROR: inode marked use but not found in a directory."
+expect twoerrors 1 "ERROR: address used by inode but marked free in bitmap."
+expect twolinks 1 "ERROR: bad reference count for file."
+expect dirtwice 1 "ERROR: directory appears more than once in file system."
+expect farentry 1 "ERROR: inode referred to in directory but marked free."
+
+# A pointer into metadata keeps the message of Point 2; the site line names
+# the region it hits
+for case in "metaaddr:block 3 (inode table)" "logaddr:block 1020 (log)"; do
+    site=$(cd "$WORK" && "$FCHECK" "${case%%:*}.img" 2>&1 | sed -n 2p)
+    if [ "$site" != "  inode 2 (/README), ${case#*:}" ]; then
+        printf 'FAIL %s site line: got "%s"\n' "${case%%:*}" "$site"
+        failed=1
+    else
+        printf 'ok   %s site line\n' "${case%%:*}"
+    fi
+done
+
+# An entry naming the root is a directory cycle; the tree walks of --digest
+# and --extract are not reached
+expect rootcycle 1 "ERROR: directory appears more than once in file system."
+expect rootcycle 1 "ERROR: directory appears more than once in file system." --digest
+
+# The walks of --digest and --extract keep their own stacks, so 5000 nested
+# directories neither overflow the C stack nor a host path
+expect deep 0 ""
+expect deep 0 "fab4f1b4152d64aa  /" --digest
+expect deep 0 "" --extract / deep.out
+if [ "$(find "$WORK/deep.out" -type d | wc -l)" != 5001 ]; then
+    echo "FAIL deep --extract: not every directory was created"
+    failed=1
+fi
+
+# --extract creates nothing outside its destination: not for an entry named
+# "../../pwned", and not through a symbolic link already in the destination
+expect hostile 0 ""
+mkdir -p "$WORK/a/b"
+expect hostile 1 'extract failed: unsafe file name "../../pwned" in inode 2' --extract / a/b/hostile.out
+mkdir -p "$WORK/linked.out"
+ln -s ../victim "$WORK/linked.out/README"
+expect good 1 "extract failed: README: File exists" --extract / linked.out
+if [ -e "$WORK/a/pwned" ] || [ -e "$WORK/victim" ]; then
+    echo "FAIL --extract wrote outside its destination"
+    failed=1
+fi
+
+# --delta and --replay over good.img report the same error as the full
+# check of the damaged image, the first in full-check order when there are
+# several
+for delta in "$WORK"/*.delta; do
+    image=$(basename "$delta" .delta)
+    full=$(cd "$WORK" && "$FCHECK" "$image.img" 2>&1 | head -n 1)
+    incremental=$(cd "$WORK" && "$FCHECK" --delta "$image.delta" good.img 2>&1 | tail -n 1)
+    if [ "$incremental" != "$image.delta: ${full:-ok}" ]; then
+        printf 'FAIL %s --delta: got "%s", full check "%s"\n' "$image" "$incremental" "$full"
+        failed=1
+    else
+        printf 'ok   %s --delta\n' "$image"
+    fi
+done
+
+expect good 1 "ERROR: write 1 (block 31): inode referred to in directory but marked free." --replay farentry.delta
+
+# A verdict cache learned from good.img still lets damage through, and a
+# cache file that fails its checksum is discarded and rewritten
+expect good 0 "" --cache verdict.cache
+expect good 0 "" --cache verdict.cache
+expect baddirect 1 "ERROR: bad direct address in inode." --cache verdict.cache
+expect nlink 1 "ERROR: bad reference count for file." --cache verdict.cache
+printf '\377' | dd of="$WORK/verdict.cache" bs=1 seek=40 conv=notrunc 2> /dev/null
+expect good 0 "verdict cache: verdict.cache is damaged, starting over" --cache verdict.cache
+expect good 0 "" --cache verdict.cache
+
+# A failed check leaves no temporary --export columns behind
+expect nlink 1 "ERROR: bad reference count for file." --export nlink.export
+expect good 0 "" --export good.export
+if ls "$WORK"/nlink.export/*.tmp > /dev/null 2>&1 || [ ! -f "$WORK/good.export/schema" ]; then
+    echo "FAIL export columns"
+    failed=1
+else
+    echo "ok   export columns"
+fi
+
+# A run that passes the check but then fails --manifest counts as failed
+# in --metrics, and not towards throughput
+echo "/nothere file -" > "$WORK/missing.manifest"
+expect good 1 "ERROR: manifest: missing /nothere" --metrics good.prom --manifest missing.manifest
+if grep -q '^fcheck_images_checked_total{result="failed"} 1$' "$WORK/good.prom" \
+    && ! grep -q '^fcheck_throughput_bytes_per_second' "$WORK/good.prom"; then
+    echo "ok   metrics of a failed manifest"
+else
+    echo "FAIL metrics of a failed manifest"
+    failed=1
+fi
+
+# --diff between images of different sizes, in both directions
+expect grown 1 "superblock: size 1024 -> 1400, nblocks 985 -> 1361, ninodes 200 -> 200" --diff good.img
+expect good 1 "superblock: size 1400 -> 1024, nblocks 1361 -> 985, ninodes 200 -> 200" --diff grown.img
+
+# Data blocks past 4 GB, read through 64-bit offsets
+expect huge 0 ""
+expect huge 0 "afdbad5848e74836  /" --digest --threads 1
+expect hugebad 1 "ERROR: bad reference count for file."
+
+# The shell rejects a block number that is not one or does not fit in 32
+# bits, rather than wrapping it
+owner=$(printf 'owner 99999999999\nowner 12x\n' | "$FCHECK" --shell "$WORK/good.img" | tail -n 2)
+if [ "$owner" != "$(printf 'no such block: 99999999999\nno such block: 12x')" ]; then
+    printf 'FAIL shell owner: got "%s"\n' "$owner"
+    failed=1
+else
+    echo "ok   shell owner"
+fi
+
+# A GPT is read only within its entry array, and not at all with entries
+# smaller than the entry structure
+expect gpt 0 "partition 1 (offset 32768, 524288 bytes): ok"
+expect gptsmall 1 "ERROR: bad superblock."
+
+# The trace stays valid JSON when a span is named after a file with quotes
+# and backslashes in its name
+: > "$WORK/q\"uo\\te.delta"
+if (cd "$WORK" && "$FCHECK" --trace trace.json --delta 'q"uo\te.delta' good.img > /dev/null) \
+    && python3 -c 'import json, sys; json.load(open(sys.argv[1]))' "$WORK/trace.json" 2> /dev/null; then
+    echo "ok   trace with escaped names"
+else
+    echo "FAIL trace with escaped names"
+    failed=1
+fi
+
+exit $failed